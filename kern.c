@@ -477,7 +477,7 @@ display()
 {
 	if (time_real < sim_begin)
 		return;
-#ifdef NTP_L64
+#if defined(NTP_L64) || defined(NTP_L128)
 	if (fmtsw) {
 		printf("%ld %.3f %.3f\n",
 		    TIMEVAR.tv_sec,
@@ -490,7 +490,13 @@ display()
 	    TIMEVAR.tv_sec,
 	    (double)L_GINT(time_offset) / 1000,
 	    (double)L_GINT(time_freq) / 1000,
+#ifdef NTP_L128
+	    (unsigned long long)(time_offset >> 32),
+	    (unsigned long long)(time_freq >> 32),
+	    (unsigned long long)(time_adj >> 32));
+#else
 	    time_offset, time_freq, time_adj);
+#endif /* NTP_L128 */
 #else
 	(void)printf(
 	    "%6ld%12.3f%9.3f %08lx%08lx %08lx%08lx %08lx%08lx\n",
@@ -503,7 +509,7 @@ display()
 	    time_freq.l_uf & 0xffffffff,
 	    time_adj.l_i & 0xffffffff,
 	    time_adj.l_uf & 0xffffffff);
-#endif /* NTP_L64 */
+#endif /* NTP_L64 || NTP_L128 */
 }
 
 /*
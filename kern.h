@@ -35,6 +35,12 @@
  */
 #define HZ		100	/* default tick interrupt frequency */
 
+/*
+ * NTP_HZ may be defined to the tick rate the kernel is configured for.
+ * ntp_tick_adjust() then divides by a constant (falling back to the
+ * hz variable should it differ at run time).
+ */
+
 /*
  * Kernel header files which should already be in /usr/include/sys.
  */
@@ -84,6 +90,26 @@ typedef struct timespec {	/* definition per POSIX.4 */
 #undef NTP_L64
 #endif
 
+/*
+ * If NTP_L128 is defined, time and frequency variables are 128-bit
+ * fixed-point quantities with 64 fraction bits (see l_fp.h). This
+ * requires __int128 support and is meant for simulation only.
+ */
+#ifdef NTP_L128
+#undef NTP_L64
+#endif
+
+/*
+ * If NTP_I64 is defined (and NTP_L64 is not), the 32-bit representation
+ * is used but the arithmetic is done with the compiler's 64-bit integer
+ * support instead of half-word carry chains (see l_fp.h). The results
+ * are identical; the code is shorter and faster on ColdFire and most
+ * other 32-bit CPUs.
+ */
+#if !defined(NTP_L64) && !defined(NTP_L128) && !defined(NTP_NO_I64)
+#define NTP_I64				/* 64-bit integer ops on 32-bit l_fp */
+#endif
+
 /*
  * Package header files which should be copied to /usr/include/sys.
  */
@@ -107,9 +133,25 @@ typedef struct timespec {	/* definition per POSIX.4 */
 #define _KERNEL			/* supppress /usr/include/time.h */
 #define ROOT		0	/* 0 = superuser, 1 = other */
 #define CPU_CLOCK	433000000 /* default CPU clock speed (Hz) */
+#ifdef __rtems__
+#include <rtems.h>		/* RTEMS_SMP */
+#endif
+#ifndef NCPUS
+#ifdef RTEMS_SMP
+#define NCPUS		32	/* max. number of SMP processors */
+#else
 #define NCPUS		1	/* number of SMP processors */
+#endif
+#endif
 #define MASTER_CPU	0	/* where the tick interrupts go */
 
+/*
+ * Leap smear shapes (time_smear_mode). With a nonzero smear window,
+ * leap seconds are spread over the window instead of being stepped.
+ */
+#define SMEAR_LINEAR	0	/* constant rate */
+#define SMEAR_COSINE	1	/* raised cosine */
+
 /*
  * Function declarations
  */
@@ -127,8 +169,15 @@ extern void second_overflow(struct timeval *);
 
 extern double gauss(double);
 extern void ntp_init(void);
+extern void ntp_set_hz(int);
 extern void hardpps(struct timespec *, long);
 extern long nano_time(struct timespec *);
+extern int64_t nano_time_ns(void);	/* same, ns since the epoch */
+extern int64_t nano_time_peek(void);	/* same, lock-free; not clamped */
+extern int64_t nano_time_coarse(void);	/* same, at the last tick */
+extern int nano_time_scale(int64_t *, int64_t *, int64_t *, int64_t *);
+extern int ntp_gettai(struct timespec *);
+extern long ntp_smear(long, long);
 extern void microset(void);
 
 /* allow for running in task driven mode: 
@@ -140,9 +189,12 @@ extern void microset(void);
  */
 
 extern int cpu_number(void);
+extern int64_t pcc_rate;	/* PCC rate (Hz) seeding microset() */
 
 
 extern int ntp_adjtime(struct timex *);
+extern int ntp_time_state(void);
+extern int ntp_adjtime_apply(struct timex *);
 
 /*
  * The following variables and functions are defined in the Unix kernel.
@@ -157,14 +209,34 @@ extern int splextreme(), splsched(), splclock(), splx();
 #ifdef __rtems__
 #include "rtemsdep.h"
 #endif
+#ifndef splx_sched
+#define splx_sched(s)	splx(s)	/* undo splsched(), splextreme() */
+#endif
 
 /*
  * The following variables are defined in the nanokernel code.
  */
 extern long time_tick;		/* nanoseconds per tick (ns) */
+extern long time_tolerance;	/* maxerror growth rate (ns/s) */
+extern long time_maxerror;	/* maximum error (us) */
+extern long time_errfrac;	/* maxerror growth residual (ns) */
+extern long time_smear;		/* leap smear window (s) */
+extern int time_smear_mode;	/* leap smear shape */
+extern long time_smear_len;	/* smear duration, 0 = idle (s) */
+extern long time_leapstep;	/* net leap steps of the clock (s) */
 extern long master_pcc;		/* master PCC at interrupt */
 extern int master_cpu;		/* master CPU */
 extern int microset_flag[NCPUS]; /* microset() initialization filag */
 #if !defined(NTP_NANO)
 extern long time_nano;		/* nanoseconds at last tick */
 #endif /* NTP_NANO */
+
+/*
+ * Kernel time (TIMEVAR or a copy) in nanoseconds since the epoch
+ */
+#ifdef NTP_NANO
+#define TIMEVAR_NS(t)	((int64_t)(t).tv_sec * NANOSECOND + (t).tv_nsec)
+#else
+#define TIMEVAR_NS(t)	((int64_t)(t).tv_sec * NANOSECOND + \
+			    (t).tv_usec * 1000 + time_nano)
+#endif /* NTP_NANO */
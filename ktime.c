@@ -92,6 +92,7 @@
 int time_state = TIME_OK;	/* clock state */
 int time_status = STA_UNSYNC;	/* clock status bits */
 long time_tai = 0;			/* TAI offset (s) */
+long time_leapstep = 0;		/* net leap steps of the clock (s) */
 long time_monitor = 0;		/* last time offset scaled (ns) */
 long time_constant  = 0;	/* poll interval (shift) (s) */
 long time_precision = 1;	/* clock precision (ns) */
@@ -99,6 +100,8 @@ long time_maxerror = MAXPHASE / 1000; /* maximum error (us) */
 long time_esterror = MAXPHASE / 1000; /* estimated error (us) */
 long time_reftime = 0;		/* time at last adjustment (s) */
 long time_tick = 0;			/* nanoseconds per tick (ns) */
+long time_tolerance = MAXFREQ;	/* maxerror growth rate (ns/s) */
+long time_errfrac = 0;		/* maxerror growth residual (ns) */
 #if !defined(NTP_NANO)
 long time_nano = 0;			/* nanoseconds past last tick */
 #endif /* NTP_NANO */
@@ -106,6 +109,12 @@ l_fp time_offset;		/* time offset (ns) */
 l_fp time_freq;			/* frequency offset (ns/s) */
 l_fp time_adj;			/* tick adjust (ns/s) */
 l_fp time_phase;		/* time phase (ns) */
+long time_smear = 0;		/* leap smear window (s), 0 = step */
+int time_smear_mode = SMEAR_LINEAR; /* leap smear shape */
+long time_smear_start = 0;	/* second the smear started (s) */
+long time_smear_len = 0;	/* smear duration, 0 = idle (s) */
+long time_smear_phase = 0;	/* smear at start of second (ns) */
+long time_smear_rate = 0;	/* smear during this second (ns/s) */
 
 #ifdef PPS_SYNC
 /*
@@ -149,6 +158,82 @@ long pps_errcnt;		/* calibration errors */
 
 void hardupdate();
 
+/*
+ * Raised-cosine smear profile (1 - cos(pi * k / 64)) / 2 in ns
+ */
+static const long smear_cos[65] = {
+	0, 602272, 2407637, 5411745, 9607360,
+	14984373, 21529832, 29227967, 38060234, 48005353,
+	59039368, 71135695, 84265194, 98396234, 113494773,
+	129524437, 146446609, 164220523, 182803358, 202150348,
+	222214883, 242948628, 264301632, 286222453, 308658284,
+	331555073, 354857661, 378509910, 402454839, 426634763,
+	450991430, 475466163, 500000000, 524533837, 549008570,
+	573365237, 597545161, 621490090, 645142339, 668444927,
+	691341716, 713777547, 735698368, 757051372, 777785117,
+	797849652, 817196642, 835779477, 853553391, 870475563,
+	886505227, 901603766, 915734806, 928864305, 940960632,
+	951994647, 961939766, 970772033, 978470168, 985015627,
+	990392640, 994588255, 997592363, 999397728, 1000000000
+};
+
+/*
+ * smear_offset() - leap smear applied after 'elapsed' seconds (ns)
+ *
+ * The profile runs from zero at the start to one second at the end of
+ * the smear interval. It is negative for an inserted and positive for
+ * a deleted leap second.
+ */
+static long
+smear_offset(elapsed)
+	long elapsed;		/* seconds since start of smear */
+{
+	long long pos;
+	long ns;
+	int i;
+
+	if (elapsed >= time_smear_len) {
+		ns = NANOSECOND;
+	} else if (time_smear_mode == SMEAR_COSINE) {
+		pos = ((long long)elapsed << 22) / time_smear_len;
+		i = (int)(pos >> 16);
+		ns = smear_cos[i] + (long)(((long long)(smear_cos[i + 1] -
+		    smear_cos[i]) * (pos & 0xffff)) >> 16);
+	} else {
+		ns = (long)((long long)NANOSECOND * elapsed /
+		    time_smear_len);
+	}
+	return (time_state == TIME_INS ? -ns : ns);
+}
+
+/*
+ * ntp_smear() - leap smear included in the time sec.nsec (ns)
+ *
+ * This is zero unless a leap second is being smeared. The phase and
+ * rate are derived from the time given rather than taken from the
+ * last second_overflow(), which may not have run yet for the second
+ * an interpolated time is in (nsec may then exceed one second). Must
+ * be called at splclock().
+ */
+long
+ntp_smear(sec, nsec)
+	long sec;		/* seconds */
+	long nsec;		/* nanoseconds (may be >= NANOSECOND) */
+{
+	long phase, rate;
+
+	if (time_smear_len == 0)
+		return (0);
+	while (nsec >= NANOSECOND) {
+		nsec -= NANOSECOND;
+		sec++;
+	}
+	sec -= time_smear_start;
+	phase = smear_offset(sec);
+	rate = smear_offset(sec + 1) - phase;
+	return (phase + (long)((long long)rate * nsec / NANOSECOND));
+}
+
 /*
  * ntp_gettime() - NTP user application interface
  *
@@ -180,7 +265,15 @@ ntp_gettime(tp)
 	ntv.tai = time_tai;
 	splx(s);
 	*tp = ntv;		/* copy out the result structure */
+	return (ntp_time_state());
+}
 
+/*
+ * ntp_time_state() - clock state as returned by ntp_gettime()
+ */
+int
+ntp_time_state()
+{
 	/*
 	 * Status word error decode. If any of these conditions occur,
 	 * an error is returned, instead of the status word. Most
@@ -214,6 +307,47 @@ ntp_gettime(tp)
 	return (time_state);
 }
 
+/*
+ * ntp_gettai() - read the TAI time
+ *
+ * This returns the current time on the TAI timescale. While a leap
+ * second is being smeared, the smear is removed, so the result is the
+ * unsmeared time plus the TAI offset and is continuous across the
+ * leap. While an inserted second is in progress the system clock has
+ * already been set back but the TAI offset not yet been incremented;
+ * this is accounted for. TIME_ERROR is returned if the clock is not
+ * synchronized.
+ */
+int
+ntp_gettai(tsp)
+	struct timespec *tsp;	/* TAI time */
+{
+	struct timespec atv;	/* nanosecond time */
+	long long nsec;		/* nanoseconds of the second */
+	int s;			/* caller priority */
+
+	s = splclock();
+	nano_time(&atv);
+	nsec = atv.tv_nsec - ntp_smear(atv.tv_sec, atv.tv_nsec);
+	atv.tv_sec += time_tai;
+	if (time_state == TIME_OOP)
+		atv.tv_sec++;
+	splx(s);
+	while (nsec < 0) {
+		nsec += NANOSECOND;
+		atv.tv_sec--;
+	}
+	while (nsec >= NANOSECOND) {
+		nsec -= NANOSECOND;
+		atv.tv_sec++;
+	}
+	atv.tv_nsec = (long)nsec;
+	*tsp = atv;
+	if (time_status & (STA_UNSYNC | STA_CLOCKERR))
+		return (TIME_ERROR);
+	return (time_state);
+}
+
 /*
  * ntp_adjtime() - NTP daemon application interface
  *
@@ -224,11 +358,39 @@ ntp_gettime(tp)
 int
 ntp_adjtime(tp)
 	struct timex *tp;	/* pointer to argument structure */
+{
+	int rval;		/* return value */
+#ifndef ntp_adjtime_queued
+	int s;			/* caller priority */
+#endif
+
+	if (ROOT)
+		return (EPERM);
+#ifdef ntp_adjtime_queued
+	rval = ntp_adjtime_queued(tp);	/* applied by the tick routine */
+#else
+	s = splclock();
+	rval = ntp_adjtime_apply(tp);
+	splx(s);
+#endif
+	return (rval);
+}
+
+/*
+ * ntp_adjtime_apply() - ntp_adjtime() without the privilege check and
+ * locking
+ *
+ * The caller must be at splclock() or otherwise be the only writer of
+ * the clock variables (e.g., the tick routine applying a queued
+ * request).
+ */
+int
+ntp_adjtime_apply(tp)
+	struct timex *tp;	/* pointer to argument structure */
 {
 	struct timex ntv;	/* temporary structure */
 	long freq;		/* frequency ns/s) */
 	int modes;		/* mode bits from structure */
-	int s;			/* caller priority */
 
 	ntv = *tp;		/* copy in the argument structure */
 
@@ -242,9 +404,6 @@ ntp_adjtime(tp)
 	 * status words are reset to the initial values at boot.
 	 */
 	modes = ntv.modes;
-	if (ROOT)
-		return (EPERM);
-	s = splclock();
 	if (modes & MOD_MAXERROR)
 		time_maxerror = ntv.maxerror;
 	if (modes & MOD_ESTERROR)
@@ -326,7 +485,7 @@ ntp_adjtime(tp)
 		ntv.precision = time_precision;
 	else
 		ntv.precision = time_precision / 1000;
-	ntv.tolerance = MAXFREQ * SCALE_PPM;
+	ntv.tolerance = time_tolerance * SCALE_PPM;
 #ifdef PPS_SYNC
 	ntv.shift = pps_shift;
 	ntv.ppsfreq = L_GINT(pps_freq) * SCALE_PPM;
@@ -340,7 +499,6 @@ ntp_adjtime(tp)
 	ntv.jitcnt = pps_jitcnt;
 	ntv.stbcnt = pps_stbcnt;
 #endif /* PPS_SYNC */
-	splx(s);
 	*tp = ntv;		/* copy out the result structure */
 
 	/*
@@ -368,6 +526,20 @@ ntp_adjtime(tp)
  * routine second_overflow()) should be called early in the hardclock()
  * code path. 
  */
+/*
+ * TICK_DIV() divides a phase value by k * hz. If NTP_HZ is defined to
+ * the tick rate the kernel is built for, the divisor is a compile-time
+ * constant in the common case and the compiler reduces the division to
+ * a multiply and shift; the generic division is kept in case hz is
+ * changed at run time.
+ */
+#ifdef NTP_HZ
+#define TICK_DIV(x, k)	(hz == NTP_HZ ? (x) / ((k) * NTP_HZ) : \
+			    (x) / ((k) * hz))
+#else
+#define TICK_DIV(x, k)	((x) / ((k) * hz))
+#endif /* NTP_HZ */
+
 void
 ntp_tick_adjust(tvp, tick_update)
 #ifdef NTP_NANO
@@ -387,18 +559,18 @@ ntp_tick_adjust(tvp, tick_update)
 #ifdef NTP_NANO
 	time_update = tick_update;
 	L_ADD(time_phase, time_adj);
-	ltemp = L_GINT(time_phase) / hz;
+	ltemp = TICK_DIV(L_GINT(time_phase), 1);
 	time_update += ltemp;
 	L_ADDHI(time_phase, -ltemp * hz);
 	tvp->tv_nsec += time_update;
 #else
 	time_update = tick_update;
 	L_ADD(time_phase, time_adj);
-	ltemp = L_GINT(time_phase) / (1000 * hz);
+	ltemp = TICK_DIV(L_GINT(time_phase), 1000);
 	time_update += ltemp;
 	L_ADDHI(time_phase, -ltemp * (1000 * hz));
 	tvp->tv_usec += time_update;
-	time_nano = L_GINT(time_phase) / hz;
+	time_nano = TICK_DIV(L_GINT(time_phase), 1);
 #endif /* NTP_NANO */
 }
 
@@ -419,6 +591,7 @@ second_overflow(tvp)
 #endif /* NTP_NANO */
 {
 	l_fp ftemp;		/* 32/64-bit temporary */
+	long ltemp;
 
 	/*
 	 * On rollover of the second both the nanosecond and microsecond
@@ -435,7 +608,16 @@ second_overflow(tvp)
 		tvp->tv_usec -= 1000000;
 #endif /* NTP_NANO */
 		tvp->tv_sec++;
-		time_maxerror += MAXFREQ / 1000;
+
+		/*
+		 * The maximum error grows by the frequency tolerance,
+		 * which is normally MAXFREQ but may be set to a tighter
+		 * bound by a holdover model. The residual below one
+		 * microsecond is carried over to the next second.
+		 */
+		time_errfrac += time_tolerance;
+		time_maxerror += time_errfrac / 1000;
+		time_errfrac %= 1000;
 
 		/*
 		 * Leap second processing. If in leap-insert state at
@@ -465,8 +647,14 @@ second_overflow(tvp)
 			if (!(time_status & STA_INS))
 				time_state = TIME_OK;
 			else if (tvp->tv_sec % 86400 == 0) {
-				tvp->tv_sec--;
-				time_state = TIME_OOP;
+				if (time_smear_len) {
+					time_tai++;
+					time_state = TIME_WAIT;
+				} else {
+					tvp->tv_sec--;
+					time_leapstep--;
+					time_state = TIME_OOP;
+				}
 			}
 			break;
 
@@ -476,8 +664,14 @@ second_overflow(tvp)
 			case TIME_DEL:
 			if (!(time_status & STA_DEL))
 				time_state = TIME_OK;
-			else if ((tvp->tv_sec + 1) % 86400 == 0) {
+			else if (time_smear_len) {
+				if (tvp->tv_sec % 86400 == 0) {
+					time_tai--;
+					time_state = TIME_WAIT;
+				}
+			} else if ((tvp->tv_sec + 1) % 86400 == 0) {
 				tvp->tv_sec++;
+				time_leapstep++;
 				time_tai--;
 				time_state = TIME_WAIT;
 			}
@@ -499,6 +693,34 @@ second_overflow(tvp)
 				time_state = TIME_OK;
 		}
 
+		/*
+		 * Leap smear processing. If a smear window is configured,
+		 * the leap second is not stepped at midnight but spread
+		 * over the window preceding it by biasing the tick
+		 * adjustment. The smear starts when the remaining time
+		 * to midnight fits the window and ends at midnight,
+		 * when the TAI offset is updated. If the leap is
+		 * cancelled in the meantime, the residual is left to
+		 * the discipline loop.
+		 */
+		if (time_state != TIME_INS && time_state != TIME_DEL)
+			time_smear_len = 0;
+		else if (time_smear_len == 0 && time_smear > 0 &&
+		    tvp->tv_sec % 86400 != 0 && 86400 - tvp->tv_sec %
+		    86400 <= time_smear) {
+			time_smear_start = tvp->tv_sec;
+			time_smear_len = 86400 - tvp->tv_sec % 86400;
+		}
+		if (time_smear_len) {
+			ltemp = tvp->tv_sec - time_smear_start;
+			time_smear_phase = smear_offset(ltemp);
+			time_smear_rate = smear_offset(ltemp + 1) -
+			    time_smear_phase;
+		} else {
+			time_smear_phase = 0;
+			time_smear_rate = 0;
+		}
+
 		/*
 		 * Compute the total time adjustment for the next second
 		 * in ns. The offset is reduced by a factor depending on
@@ -519,7 +741,7 @@ second_overflow(tvp)
 		time_adj = ftemp;
 		L_SUB(time_offset, ftemp);
 		L_ADD(time_adj, time_freq);
-		L_ADDHI(time_adj, NANOSECOND);
+		L_ADDHI(time_adj, NANOSECOND + time_smear_rate);
 #ifdef PPS_SYNC
 		if (pps_valid > 0)
 			pps_valid--;
@@ -529,6 +751,29 @@ second_overflow(tvp)
 	}
 }
 
+/*
+ * ntp_set_hz() - change the tick frequency while running
+ *
+ * This routine must be called at splclock() at a tick boundary, i.e.,
+ * after ntp_tick_adjust() and before the first tick at the new rate.
+ * The residual phase carried over in time_phase is in units of 1/hz ns
+ * and is rescaled, so that the clock neither gains nor loses time.
+ * time_adj holds the adjustment per second and need not be changed.
+ */
+void
+ntp_set_hz(newhz)
+	int newhz;		/* new tick interrupt frequency (Hz) */
+{
+	long ltemp;
+
+	if (newhz <= 0 || newhz == hz)
+		return;
+	ltemp = L_GINT(time_phase);
+	L_ADDHI(time_phase, ltemp * newhz / hz - ltemp);
+	hz = newhz;
+	time_tick = NANOSECOND / hz;
+}
+
 /*
  * ntp_init() - initialize variables and structures
  *
@@ -604,6 +849,16 @@ hardupdate(tvp, offset)
 	long mtemp;
 	l_fp ftemp;
 
+	/*
+	 * A leap smear is deliberate; take it out of the offset so
+	 * that the loop doesn't work against it.
+	 */
+#ifdef NTP_NANO
+	offset += ntp_smear(tvp->tv_sec, tvp->tv_nsec);
+#else
+	offset += ntp_smear(tvp->tv_sec, tvp->tv_usec * 1000);
+#endif /* NTP_NANO */
+
 	/*
 	 * Select how the phase is to be controlled and from which
 	 * source. If the PPS signal is present and enabled to
@@ -696,9 +951,8 @@ hardpps(tsp, nsec)
 	 * PPM. If two hits occur in the same second, we ignore the
 	 * later hit; if not and a hit occurs outside the range gate,
 	 * keep the later hit for later comparison, but do not process
-	 * it.
+	 * it. Note that time_tick is maintained by ntp_init().
 	 */
-	time_tick = NANOSECOND / hz;
 	time_status |= STA_PPSSIGNAL | STA_PPSJITTER;
 	time_status &= ~(STA_PPSWANDER | STA_PPSERROR);
 	pps_valid = PPS_VALID;
@@ -24,10 +24,47 @@
  * This file contains macro sets for 64-bit arithmetic and logic
  * operations in both 32-bit and 64-bit architectures. They are designed
  * to use the same source code in either architecture, with all
- * differences confined to this file. Macros adapted from the NTP
+ * differences confined to this file. A 128-bit extended-precision
+ * set (NTP_L128) can be selected for simulation. Macros adapted from the NTP
  * distribution ntp_fp.h, original author Dennis Ferguson.
  */
-#if !defined(NTP_L64)
+#if defined(NTP_L128)
+
+/*
+ * Extended-precision macros
+ *
+ * A 128-bit fixed-point value is represented as a single 128-bit word
+ * with the implied decimal point to the left of bit 64. The integral
+ * part has the same range as in the other formats, but the resolution
+ * is about 5.4e-20 ns (ns/s) rather than 2.3e-10 ns (ns/s). Rounding
+ * (truncation toward zero in L_RSHIFT() and L_GINT()) is the same as
+ * in the other formats. This is intended for simulation, in order to
+ * study whether finer time_phase/time_freq resolution reduces the
+ * steady-state wander; it requires a compiler providing __int128.
+ */
+#ifndef __SIZEOF_INT128__
+#error "NTP_L128 requires a compiler with __int128 support"
+#endif
+
+typedef __int128 l_fp;
+#define L_ADD(v, u)	((v) += (u))
+#define L_SUB(v, u)	((v) -= (u))
+#define L_ADDHI(v, a)	((v) += (__int128)(a) << 64)
+#define L_NEG(v)	((v) = -(v))
+#define L_RSHIFT(v, n) \
+	do { \
+		if ((v) < 0) \
+			(v) = -(-(v) >> (n)); \
+		else \
+			(v) = (v) >> (n); \
+	} while (0)
+#define L_MPY(v, a)	((v) *= (a))
+#define L_CLR(v)	((v) = 0)
+#define L_ISNEG(v)	((v) < 0)
+#define L_LINT(v, a)	((v) = (__int128)(a) << 64)
+#define L_GINT(v)	((long long)((v) < 0 ? -(-(v) >> 64) : (v) >> 64))
+
+#elif !defined(NTP_L64)
 
 #include <stdint.h>
 
@@ -69,6 +106,61 @@ typedef struct {			/* basic type in two formats */
 #define l_uf	Ul_f.Xl_uf		/* unsigned fractional part */
 #define l_f	Ul_f.Xl_f		/* signed fractional part */
 
+#ifdef NTP_I64
+/*
+ * If NTP_I64 is defined, the operations are implemented using the
+ * native 64-bit integer support of the compiler, which on most 32-bit
+ * machines results in add/subtract with carry and a few multiplies
+ * rather than half-word carry chains. The representation is unchanged
+ * and the results are bit-for-bit identical to those of the half-word
+ * macros below. M_MPY() is exact for any multiplier, whereas the
+ * half-word version requires 0 <= m < 65536.
+ */
+#define M_JOIN(v_i, v_f) \
+	(((uint64_t)(u_int32)(v_i) << 32) | (u_int32)(v_f))
+
+#define M_SPLIT(v_i, v_f, x) \
+	do { \
+		(v_i) = (int32)((x) >> 32); \
+		(v_f) = (u_int32)(x); \
+	} while (0)
+
+#define M_ADD(r_i, r_f, a_i, a_f)	/* r += a */ \
+	do { \
+		uint64_t x_tmp = M_JOIN(r_i, r_f) + M_JOIN(a_i, a_f); \
+		M_SPLIT(r_i, r_f, x_tmp); \
+	} while (0)
+
+#define M_SUB(r_i, r_f, a_i, a_f)	/* r -= a */ \
+	do { \
+		uint64_t x_tmp = M_JOIN(r_i, r_f) - M_JOIN(a_i, a_f); \
+		M_SPLIT(r_i, r_f, x_tmp); \
+	} while (0)
+
+#define M_NEG(v_i, v_f)  /* v = -v */ \
+	do { \
+		uint64_t x_tmp = -M_JOIN(v_i, v_f); \
+		M_SPLIT(v_i, v_f, x_tmp); \
+	} while (0)
+
+#define M_RSHIFT(v_i, v_f, n)		/* v >>= n */ \
+	do { \
+		int64_t x_tmp = (int64_t)M_JOIN(v_i, v_f); \
+		if (x_tmp < 0) \
+			x_tmp = -(-x_tmp >> (n)); \
+		else \
+			x_tmp = x_tmp >> (n); \
+		M_SPLIT(v_i, v_f, (uint64_t)x_tmp); \
+	} while (0)
+
+#define M_MPY(v_i, v_f, m)		/* v *= m */ \
+	do { \
+		uint64_t x_tmp = M_JOIN(v_i, v_f) * (uint64_t)(int64_t)(m); \
+		M_SPLIT(v_i, v_f, x_tmp); \
+	} while (0)
+
+#else /* NTP_I64 */
+
 #define M_ADD(r_i, r_f, a_i, a_f)	/* r += a */ \
 	do { \
 		register u_int32 lo_tmp; \
@@ -164,6 +256,9 @@ typedef struct {			/* basic type in two formats */
 			(v_f) = (c << 16) + (d & 0xffff); \
 		} \
 	} while (0)
+
+#endif /* NTP_I64 */
+
 /*
  * Operations - u,v are 64 bits; a,n are 32 bits.
  */
@@ -209,4 +304,4 @@ typedef long long l_fp;
 #define L_LINT(v, a)	((v) = (long long)(a) << 32)
 #define L_GINT(v)	((v) < 0 ? -(-(v) >> 32) : (v) >> 32)
 
-#endif /* NTP_L64 */
+#endif /* NTP_L128, NTP_L64 */
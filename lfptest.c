@@ -0,0 +1,158 @@
+/*
+ * Compare the NTP_I64 l_fp macros (64-bit integer ops on the 32-bit
+ * representation) against the legacy half-word macros on random
+ * operands.
+ *
+ * This file is compiled three times (see Makefile.host 'check'):
+ * with -DLFP_PFX=i64_ -DNTP_I64 and with -DLFP_PFX=leg_ for the two
+ * macro sets, and with -DLFPTEST_MAIN for the driver.
+ *
+ * The legacy M_MPY() is only exact for 0 <= m < 65536 and M_RSHIFT()
+ * is undefined for n == 0 (shift by 32), so the operands are limited
+ * accordingly.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef struct {
+	int32_t		i;
+	uint32_t	f;
+} lfpt;
+
+#define OP_ADD		0
+#define OP_SUB		1
+#define OP_ADDHI	2
+#define OP_NEG		3
+#define OP_RSHIFT	4
+#define OP_MPY		5
+#define NOPS		6
+
+#ifndef LFPTEST_MAIN
+
+#undef NTP_L64
+#undef NTP_L128
+#include "l_fp.h"
+
+#define CAT_(a, b)	a ## b
+#define CAT(a, b)	CAT_(a, b)
+
+/* (not 'a': the legacy M_MPY() declares locals a, b, c, d) */
+void
+CAT(LFP_PFX, op)(int op, lfpt *r, const lfpt *u, int32_t arg)
+{
+	l_fp v, w;
+
+	v.l_i = r->i;
+	v.l_uf = r->f;
+	w.l_i = u->i;
+	w.l_uf = u->f;
+
+	switch (op) {
+	case OP_ADD:
+		L_ADD(v, w);
+		break;
+	case OP_SUB:
+		L_SUB(v, w);
+		break;
+	case OP_ADDHI:
+		L_ADDHI(v, arg);
+		break;
+	case OP_NEG:
+		L_NEG(v);
+		break;
+	case OP_RSHIFT:
+		L_RSHIFT(v, arg);
+		break;
+	case OP_MPY:
+		L_MPY(v, arg);
+		break;
+	}
+	r->i = v.l_i;
+	r->f = v.l_uf;
+}
+
+#else /* LFPTEST_MAIN */
+
+void i64_op(int, lfpt *, const lfpt *, int32_t);
+void leg_op(int, lfpt *, const lfpt *, int32_t);
+
+static const char *opname[NOPS] = {
+	"L_ADD", "L_SUB", "L_ADDHI", "L_NEG", "L_RSHIFT", "L_MPY"
+};
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t
+rnd32(void)
+{
+	/* xorshift64* */
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (uint32_t)((rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/* random word, biased towards the edge cases */
+static uint32_t
+rndword(void)
+{
+	static const uint32_t edge[] = {
+		0, 1, 0xffffffff, 0x7fffffff, 0x80000000, 0xffff, 0x10000
+	};
+
+	if ((rnd32() & 7) == 0)
+		return edge[rnd32() % (sizeof(edge) / sizeof(edge[0]))];
+	return rnd32();
+}
+
+int
+main(int argc, char **argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 1000000;
+	long k, bad = 0;
+	lfpt v, x, y, u;
+	int32_t a;
+	int op;
+
+	for (k = 0; k < n; k++) {
+		op = k % NOPS;
+		x.i = (int32_t)rndword();
+		x.f = rndword();
+		u.i = (int32_t)rndword();
+		u.f = rndword();
+		switch (op) {
+		case OP_RSHIFT:
+			a = 1 + rnd32() % 31;
+			break;
+		case OP_MPY:
+			a = rnd32() & 0xffff;
+			break;
+		default:
+			a = (int32_t)rndword();
+			break;
+		}
+		v = x;
+		y = x;
+		i64_op(op, &x, &u, a);
+		leg_op(op, &y, &u, a);
+		if (x.i != y.i || x.f != y.f) {
+			if (bad++ < 10)
+				printf("%s: v %08lx.%08lx u %08lx.%08lx a %ld: "
+				    "I64 %08lx.%08lx legacy %08lx.%08lx\n",
+				    opname[op],
+				    (unsigned long)(uint32_t)v.i,
+				    (unsigned long)v.f,
+				    (unsigned long)(uint32_t)u.i,
+				    (unsigned long)u.f, (long)a,
+				    (unsigned long)(uint32_t)x.i,
+				    (unsigned long)x.f,
+				    (unsigned long)(uint32_t)y.i,
+				    (unsigned long)y.f);
+		}
+	}
+	printf("lfptest: %ld operations, %ld mismatches\n", n, bad);
+	return (bad != 0);
+}
+
+#endif /* LFPTEST_MAIN */
@@ -17,7 +17,20 @@
  **********************************************************************/
 
 #include "kern.h"
+#ifdef __rtems__
+#include <bsp.h>
+#include "pcc.h"
+#else
 #include "pcc-host.h"
+#endif
+#ifdef USE_PCC_LSQ
+#include "pcclsq.h"
+#endif
+
+/*
+ * The RTEMS port uses this module on SMP systems only.
+ */
+#if !defined(__rtems__) || defined(RTEMS_SMP)
 
 /*
  * Nanosecond time routines
@@ -66,20 +79,56 @@
  * the current PCC contents, where PCC_WIDTH is the number of signficant
  * bits.
  */
+#ifdef RTEMS_SMP
+/*
+ * The ticker runs on another CPU; retry if it was updating the clock.
+ */
+#define TIME_READ(t)	do {						\
+	unsigned long seq_;						\
+	do {								\
+		seq_ = rtems_ntp_timevar_seq;				\
+		__sync_synchronize();					\
+		(t) = TIMEVAR;						\
+		__sync_synchronize();					\
+	} while ((seq_ & 1) || seq_ != rtems_ntp_timevar_seq);	\
+} while (0)
+#else
 #define TIME_READ(t)	((t) = TIMEVAR) /* read microsecond clock */
+#endif
+
+/*
+ * PCC_MASK masks the significant PCC bits; PCC_WRAP is the PCC
+ * modulus (zero if the PCC is as wide as the arithmetic).
+ */
+#if PCC_WIDTH < 64
+#define PCC_MASK	((1LL << PCC_WIDTH) - 1)
+#define PCC_WRAP	(1LL << PCC_WIDTH)
+#else
+#define PCC_MASK	(~0LL)
+#define PCC_WRAP	0
+#endif
 
 /*
  * The following arrays are used to discipline the time in each
  * processor of a multiprocessor system to a nominal timescale based on
  * the tick inteval.
  */
-struct timespec pcc_time[NCPUS]; /* time at last microset() call */
+int64_t pcc_time[NCPUS];	/* time at last microset() call (ns) */
 int64_t pcc_pcc[NCPUS];	/* PCC at last microset() */
 int64_t pcc_numer[NCPUS];	/* change in time last interval */
 int64_t pcc_denom[NCPUS];	/* change in PCC last interval */
 long pcc_master[NCPUS];		/* master PCC at last microset() (ns) */
 int microset_flag[NCPUS];	/* microset() initialization flag */
 long master_pcc;		/* master PCC at interrupt (ns) */
+int64_t pcc_rate = CPU_CLOCK;	/* PCC rate (Hz); may be calibrated */
+#ifdef USE_PCC_LSQ
+PccLsqRec pcc_lsq[NCPUS];	/* PCC rate estimators */
+#endif
+#ifdef USE_PCC_SLEW
+int64_t pcc_tick[NCPUS];	/* kernel time at last microset() (ns) */
+#endif
+
+static void microset_ns(pcc_t, int64_t);
 
 /*
  * nano_time_rpcc() - read the system clock and PCC
@@ -87,11 +136,12 @@ long master_pcc;		/* master PCC at interrupt (ns) */
  * This routine reads the system clock and process cycle counter (PCC)
  * as an atomic operation. Note that in some architectures the PCC width
  * is less than the machine word, but in no case less than PCC_WIDTH
- * bits, and the high order bits may be junk.
+ * bits, and the high order bits may be junk. The time is returned in
+ * nanoseconds since the epoch.
  */
 pcc_t
-nano_time_rpcc(tsp)
-	struct timespec *tsp;	/* nanosecond clock */
+nano_time_rpcc(nsp)
+	int64_t *nsp;		/* nanosecond clock */
 {
 #ifdef NTP_NANO
 	struct timespec t;	/* nanosecond clock */
@@ -102,14 +152,8 @@ nano_time_rpcc(tsp)
 
 	TIME_READ(t);		/* must be atomic */
 	pcc = rpcc();
-#ifdef NTP_NANO
-	tsp->tv_sec = t.tv_sec;
-	tsp->tv_nsec = t.tv_nsec;
-#else
-	tsp->tv_sec = t.tv_sec;
-	tsp->tv_nsec = t.tv_usec * 1000 + time_nano;
-#endif /* NTP_NANO */
-	return (pcc & ((1LL << PCC_WIDTH) - 1));
+	*nsp = TIMEVAR_NS(t);
+	return (pcc & PCC_MASK);
 }
 
 /*
@@ -132,49 +176,56 @@ nano_time_rpcc(tsp)
  * nanosecond. In the next era when reading the clock takes less than a
  * nanosecond, we have a problem and may have to upgrade to a picosecond
  * clock.
+ *
+ * The time is reckoned in nanoseconds since the epoch (int64_t) and
+ * only nano_time() converts it to a timespec. The nanoseconds
+ * interpolated past the tick (plus the master PCC) are returned
+ * in *psecp.
  */
-long
-nano_time(tsp)
-	struct timespec *tsp;
+static int64_t
+nano_time_interp(long *psecp)
 {
-	struct timespec t, u;		/* nanosecond time */
-	static struct timespec lasttime; /* last time returned */
-	int64_t pcc, nsec, psec;	/* 64-bit temporaries */
-	time_t sec;
+#ifdef RTEMS_SMP
+	static int64_t lasttimes[NCPUS]; /* per CPU; no global lock */
+#define lasttime lasttimes[i]
+#else
+	static int64_t lasttime;	/* last time returned */
+#endif
+	int64_t t, pcc, nsec, psec;	/* 64-bit temporaries */
+	int64_t slew;			/* base off the tick (ns) */
 	int i, s;
 
+	s = splsched();			/* stay on this CPU */
 	i = cpu_number();		/* read the time on this CPU */
-	s = splsched();
 	pcc = nano_time_rpcc(&t);
 
 	/*
 	 * Determine the current clock time as the time at the last
 	 * microset() call plus the normalized PCC accumulation since
 	 * then. This time must fall between the time at the most recent
-	 * tick interrupt to the time at one tick later. Note that the
-	 * apparent accumulation can exceed one second, since the
-	 * nanosecond time can roll over before the tick interrupt that
-	 * rolls the second.
+	 * tick interrupt to the time at one tick later; with
+	 * USE_PCC_SLEW the base is off the tick by the difference being
+	 * slewed out and the bounds are widened by as much.
 	 */
+	psec = 0;
 	if (microset_flag[i]) {
 		psec = pcc - pcc_pcc[i];
 		if (psec < 0)
-			psec += 1LL << PCC_WIDTH;
-		u = pcc_time[i];
-		psec = psec * pcc_numer[i] / pcc_denom[i] -
-		    (t.tv_sec - u.tv_sec) * NANOSECOND;
-		nsec = u.tv_nsec + psec;
-		if (nsec < t.tv_nsec)
-			nsec = t.tv_nsec;
-		else if (nsec > t.tv_nsec + time_tick)
-			nsec = t.tv_nsec + time_tick;
-		t.tv_nsec = (long)nsec;
-		if (t.tv_nsec >= NANOSECOND) {
-			t.tv_nsec -= NANOSECOND;
-			t.tv_sec++;
-		}
-	} else {
-		psec = 0;
+			psec += PCC_WRAP;
+		nsec = pcc_time[i] + psec * pcc_numer[i] / pcc_denom[i];
+#ifdef USE_PCC_SLEW
+		slew = pcc_time[i] - pcc_tick[i];
+		if (slew < 0)
+			slew = -slew;
+#else
+		slew = 0;
+#endif /* USE_PCC_SLEW */
+		if (nsec < t - slew)
+			nsec = t - slew;
+		else if (nsec > t + time_tick + slew)
+			nsec = t + time_tick + slew;
+		psec = nsec - t;
+		t = nsec;
 	}
 
 	/*
@@ -186,24 +237,69 @@ nano_time(tsp)
 	 * human equivalent is presumed to be correctly implemented and
 	 * to set the clock backward only upon unavoidable catastrophe.
 	 */
-	sec = lasttime.tv_sec - t.tv_sec;
-	nsec = lasttime.tv_nsec - t.tv_nsec;
-	if (nsec < 0) {
-		nsec += NANOSECOND;
-		sec--;
-	}
-	if (sec == 0) {
-		t.tv_nsec += nsec + 1;
-		if (t.tv_nsec >= NANOSECOND) {
-			t.tv_nsec -= NANOSECOND;
-			t.tv_sec++;
-		}
-	}
-	*tsp = t;
-	lasttime = *tsp;
-	splx(s);
-	psec += pcc_master[i];
-	return ((long)psec);
+	nsec = lasttime - t;
+	if (nsec >= 0 && nsec < NANOSECOND)
+		t = lasttime + 1;
+	lasttime = t;
+#undef lasttime
+	splx_sched(s);
+	*psecp = (long)(psec + pcc_master[i]);
+	return (t);
+}
+
+/*
+ * nano_time_ns() - return the current time in nanoseconds since the
+ * epoch
+ */
+int64_t
+nano_time_ns()
+{
+	long psec;
+
+	return (nano_time_interp(&psec));
+}
+
+long
+nano_time(tsp)
+	struct timespec *tsp;
+{
+	int64_t t;
+	long psec;
+
+	t = nano_time_interp(&psec);
+	tsp->tv_sec = t / NANOSECOND;
+	tsp->tv_nsec = t % NANOSECOND;
+	return (psec);
+}
+
+/*
+ * nano_time_scale() - return the interpolation parameters of this
+ * processor
+ *
+ * These are the PCC and the time (ns) at the last microset() call and
+ * the rate (ns per PCC click) as numer/denom, so that a batch of PCC
+ * readings can be converted without reading the clock for each.
+ * Returns zero on success and nonzero if microset() hasn't initialized
+ * this processor yet.
+ */
+int
+nano_time_scale(pccp, nsp, numerp, denomp)
+	int64_t *pccp;		/* PCC at last microset() */
+	int64_t *nsp;		/* time at last microset() (ns) */
+	int64_t *numerp;	/* change in time */
+	int64_t *denomp;	/* change in PCC */
+{
+	int i, s, rval;
+
+	s = splsched();			/* stay on this CPU */
+	i = cpu_number();
+	rval = !microset_flag[i];
+	*pccp = pcc_pcc[i];
+	*nsp = pcc_time[i];
+	*numerp = pcc_numer[i];
+	*denomp = pcc_denom[i];
+	splx_sched(s);
+	return (rval);
 }
 
 /*
@@ -233,37 +329,63 @@ micro_time(tv)
 void
 microset()
 {
-struct timespec t;
+int64_t         t;
 int	            s;
 pcc_t           pcc;
 	s = splextreme();
 	pcc = nano_time_rpcc(&t);
-	splx(s);
-	microset_from_saved(pcc, &t);
+#ifdef RTEMS_SMP
+	/* nano_time() on this CPU must not see a partial update */
+	microset_ns(pcc, t);
+	splx_sched(s);
+#else
+	splx_sched(s);
+	microset_ns(pcc, t);
+#endif
 }
 
 void
 microset_from_saved(pcc_t saved_pcc, struct timespec *pt)
 {
-	struct timespec u;		/* nanosecond time */
+#ifdef RTEMS_SMP
+	int s;
+
+	s = splextreme();
+	microset_ns(saved_pcc, (int64_t)pt->tv_sec * NANOSECOND + pt->tv_nsec);
+	splx_sched(s);
+#else
+	microset_ns(saved_pcc, (int64_t)pt->tv_sec * NANOSECOND + pt->tv_nsec);
+#endif
+}
+
+static void
+microset_ns(pcc_t saved_pcc, int64_t t)
+{
+	int64_t u;			/* nanosecond time */
 	int64_t pcc, numer, denom;	/* 64-bit temporaries */
+#ifdef USE_PCC_SLEW
+	int64_t clicks, adv, d, err;
+#endif
 	int i;
 
 	i = cpu_number();		/* read the time on this CPU */
 
-	pcc = saved_pcc & ((1LL << PCC_WIDTH) - 1);
+	pcc = saved_pcc & PCC_MASK;
 
 	/*
 	 * Intialize for first reading. Use the processor rate from the
-	 * system-dependent firmware.
+	 * system-dependent firmware or a boot-time calibration.
 	 */
 	if (!microset_flag[i]) {
 		microset_flag[i]++;
 		pcc_pcc[i] = pcc;
 		pcc_master[i] = master_pcc;
-		pcc_time[i] = *pt;
+		pcc_time[i] = t;
+#ifdef USE_PCC_SLEW
+		pcc_tick[i] = t;
+#endif
 		pcc_numer[i] = NANOSECOND;
-		pcc_denom[i] = CPU_CLOCK; 
+		pcc_denom[i] = pcc_rate;
 		return;
 	}
 
@@ -272,16 +394,54 @@ microset_from_saved(pcc_t saved_pcc, struct timespec *pt)
 	 * ignore it. Things will get well on the next call.
 	 */
 	u = pcc_time[i];
-	pcc_time[i] = *pt;
-	numer = (pt->tv_sec - u.tv_sec) * NANOSECOND + pt->tv_nsec -
-	    u.tv_nsec; 
+	pcc_time[i] = t;
+#ifdef USE_PCC_SLEW
+	numer = t - pcc_tick[i];
+	pcc_tick[i] = t;
+#else
+	numer = t - u;
+#endif
 	denom = pcc - pcc_pcc[i];
 	pcc_pcc[i] = pcc;
 	pcc_master[i] = master_pcc;
 	if (denom < 0)
-		denom += 1LL << PCC_WIDTH;
+		denom += PCC_WRAP;
 	if (denom <= 0 || numer <= 0)
 		return;
+#ifdef USE_PCC_SLEW
+	clicks = denom;
+	adv = numer;
+#endif
+
+#ifdef USE_PCC_LSQ
+	/*
+	 * Smooth the rate by a fit over the last few intervals.
+	 */
+	{
+	unsigned long n, d;
+
+	if (!pcclsq_update(&pcc_lsq[i], denom, numer, &n, &d)) {
+		numer = n;
+		denom = d;
+	}
+	}
+#endif /* USE_PCC_LSQ */
+
+#ifdef USE_PCC_SLEW
+	/*
+	 * Rather than restart from the kernel time, continue from the
+	 * interpolated time and fold the difference into the rate, so
+	 * that the kernel time is met at the next call. Large
+	 * differences (clock steps) are not smoothed.
+	 */
+	d = clicks * pcc_numer[i] / pcc_denom[i];
+	err = t - u - d;
+	if (err < adv / 2 && err > -adv / 2) {
+		pcc_time[i] = u + d;
+		denom = adv * denom / numer;
+		numer = adv + err;
+	}
+#endif /* USE_PCC_SLEW */
 
 	/*
 	 * Save the numerator and denominator for later.
@@ -289,3 +449,4 @@ microset_from_saved(pcc_t saved_pcc, struct timespec *pt)
 	pcc_numer[i] = numer;
 	pcc_denom[i] = denom;
 }
+#endif /* !__rtems__ || RTEMS_SMP */
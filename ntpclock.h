@@ -0,0 +1,248 @@
+/* $Id$ */
+#ifndef RTEMS_NTP_CLOCK_H
+#define RTEMS_NTP_CLOCK_H
+
+/* Public interface of the RTEMS nanosecond clock / NTP daemon */
+
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Length (ms) of the PCC rate calibration performed by
+ * rtemsNtpInitialize(); set to 0 to skip it.
+ */
+extern unsigned rtems_ntp_pcc_calibration_ms;
+
+/* Interval (s) between checks of the hardware RTC; see
+ * rtemsNtpRtcRegister().
+ */
+extern unsigned rtems_ntp_rtc_interval;
+
+/* Start the ticker and the NTP daemon; priorities of zero select
+ * the defaults.
+ * RETURNS 0 on success.
+ */
+int rtemsNtpInitialize(unsigned tickerPri, unsigned daemonPri);
+
+/* Stop the ticker and the daemon and release resources.
+ * RETURNS 0 on success.
+ */
+int rtemsNtpCleanup(void);
+
+struct timex;
+
+/* ntp_adjtime() for applications; with USE_ADJTIME_QUEUE the request
+ * is carried out by the ticker (the caller blocks until it is done,
+ * for at most a second) and ntp_adjtime() itself takes this path.
+ * RETURNS: clock state or -1 if the request could not be posted or
+ * the ticker didn't pick it up in time.
+ */
+int rtemsNtpAdjtime(struct timex *ntv);
+
+/* Set the daemon's poll interval (>= 16s) */
+int rtemsNtpSetPollInterval(int poll_seconds);
+
+/* Run the ticker every 'divisor' system clock ticks; may be changed
+ * while running. 'divisor' must divide the system clock rate. Not
+ * supported with USE_PICTIMER.
+ * RETURNS 0 on success.
+ */
+int rtemsNtpSetTickerDivisor(unsigned divisor);
+
+/* Spread leap seconds over the 'window_secs' seconds preceding
+ * the leap rather than stepping the clock. 'window_secs' == 0
+ * selects stepping; 'cosine' != 0 selects a raised-cosine rather
+ * than a linear profile.
+ * RETURNS 0 on success, nonzero if the arguments are invalid or
+ *         a leap second is currently being smeared.
+ */
+int rtemsNtpSetLeapSmear(long window_secs, int cosine);
+
+/* Read the time at the last clock tick (resolution 1/hz). Doesn't
+ * access the PCC or take a lock; never later than the fine time.
+ */
+void rtemsNtpGetTimeCoarse(struct timespec *ts);
+
+/* Clocks for rtemsNtpClockGettime():
+ *  REALTIME:      disciplined UTC (as nano_time(); smeared during a
+ *                 leap smear).
+ *  MONOTONIC:     time since rtemsNtpInitialize(); runs at the
+ *                 disciplined rate but isn't stepped by leap seconds.
+ *  MONOTONIC_RAW: undisciplined PCC at the calibrated rate (tick
+ *                 resolution if the PCC isn't calibrated); arbitrary
+ *                 origin.
+ *  TAI:           as ntp_gettai().
+ */
+#define RTEMS_NTP_CLOCK_REALTIME		0
+#define RTEMS_NTP_CLOCK_MONOTONIC		1
+#define RTEMS_NTP_CLOCK_MONOTONIC_RAW	2
+#define RTEMS_NTP_CLOCK_TAI				3
+
+/* Read one of the clocks above from a single clock reading.
+ * RETURNS 0 on success, -1 if 'clock' is invalid.
+ */
+int rtemsNtpClockGettime(int clock, struct timespec *ts);
+
+/* Read the free-running PCC (on UP the clicks counted since the first
+ * tick; on SMP the counter itself).
+ */
+unsigned long long rtemsNtpPccRead(void);
+
+/* Convert 'n' PCC readings (from rtemsNtpPccRead() or, on SMP, latched
+ * by hardware from the same counter) to ns since the epoch, all with
+ * one snapshot of the current interpolation base and scale.
+ * RETURNS 0 on success, -1 if the PCC scale isn't known yet.
+ */
+int rtemsNtpPccToNs(const unsigned long long *pcc, long long *ns, unsigned n);
+
+/* Convert a PCC reading taken up to PCC_EPOCHS (16) ticks ago using
+ * the interpolation base and scale that were in effect at the time.
+ * RETURNS 0 on success, -1 if the reading is older than that.
+ */
+int rtemsNtpPccToNsPast(unsigned long long pcc, long long *ns);
+
+/* Event timestamp queue: an ISR records the PCC and a tag; a task
+ * later drains the queue and obtains the times of the events.
+ */
+typedef struct RtemsNtpEvQRec_ *RtemsNtpEvQ;
+
+typedef struct RtemsNtpEvRec_ {
+	long long			ns;		/* time of the event (ns since the epoch) */
+	unsigned long long	pcc;	/* PCC at the event */
+	unsigned long		tag;
+	int					approx;	/* older than the epoch ring; converted
+								 * with the current scale
+								 */
+} RtemsNtpEvRec, *RtemsNtpEv;
+
+/* Create a queue of 2^ld_size entries (one producer, one consumer).
+ * RETURNS the queue or NULL (no memory, ld_size > 20).
+ */
+RtemsNtpEvQ rtemsNtpEvQCreate(unsigned ld_size);
+
+void rtemsNtpEvQDestroy(RtemsNtpEvQ q);
+
+/* Record an event; ISR-safe (reads the PCC, doesn't block).
+ * RETURNS 0 on success, -1 if the queue is full (event dropped).
+ */
+int rtemsNtpEvQPost(RtemsNtpEvQ q, unsigned long tag);
+
+/* Remove up to 'max' events (oldest first) converting them to time.
+ * Events which can't be converted yet (the clock has no scale) stay
+ * queued.
+ * RETURNS the number of events stored in 'ev'.
+ */
+unsigned rtemsNtpEvQDrain(RtemsNtpEvQ q, RtemsNtpEv ev, unsigned max);
+
+/* RETURNS the number of events dropped because the queue was full */
+unsigned long rtemsNtpEvQDropped(RtemsNtpEvQ q);
+
+/* Read a device counter; called with interrupts disabled */
+typedef unsigned long long (*RtemsNtpDevRead)(void *arg);
+
+typedef struct RtemsNtpXtstampRec_ {
+	unsigned long long	pcc;	/* PCC (as rtemsNtpPccRead()) */
+	long long			ns;		/* time at 'pcc' (ns since the epoch) */
+	unsigned long long	dev;	/* device counter */
+	long long			width;	/* uncertainty: bracket width (ns) */
+} RtemsNtpXtstampRec, *RtemsNtpXtstamp;
+
+/* Correlate a device counter with the PCC and system time: the device
+ * read is bracketed by two PCC readings (interrupts disabled) and the
+ * narrowest of 'tries' brackets is returned, its midpoint converted
+ * to time.
+ * RETURNS 0 on success, -1 if the PCC scale isn't known yet.
+ */
+int rtemsNtpCrossTimestamp(RtemsNtpDevRead rd, void *arg, unsigned tries, RtemsNtpXtstamp xts);
+
+/* Read the time together with bounds guaranteed to contain the true
+ * time: the maximum error last set by the daemon, grown by the
+ * frequency tolerance for the time elapsed since. Lock-free.
+ * RETURNS: clock state (see ntp_gettime()).
+ */
+int rtemsNtpGetTimeBounds(long long *earliest, long long *latest);
+
+/* Timer service: callbacks at absolute (disciplined) times. The timer
+ * records are owned by the caller; the fields are private.
+ */
+typedef struct RtemsNtpTimerRec_ {
+	struct RtemsNtpTimerRec_	*next;
+	int							slot;
+	int							armed;
+	long long					when;	/* ns since the epoch */
+	void						(*fn)(void *arg);
+	void						*arg;
+} RtemsNtpTimerRec, *RtemsNtpTimer;
+
+/* Start/stop the service task ('pri' == 0 selects the default, 150;
+ * the task busy-waits for up to a system clock tick before a timer is
+ * due so it should run below time-critical tasks). Stopping disarms
+ * all timers.
+ * RETURNS 0 on success.
+ */
+int rtemsNtpTimerServiceStart(unsigned pri);
+int rtemsNtpTimerServiceStop(void);
+
+void rtemsNtpTimerInit(RtemsNtpTimer t, void (*fn)(void *arg), void *arg);
+
+/* Arm (or re-arm) 't' to call its function from the service task at
+ * 'when' (ns since the epoch); a time in the past fires at once.
+ * RETURNS 0 on success, -1 if the service isn't running.
+ */
+int rtemsNtpTimerArm(RtemsNtpTimer t, long long when);
+
+/* RETURNS 0 if the timer was disarmed, -1 if it wasn't armed */
+int rtemsNtpTimerCancel(RtemsNtpTimer t);
+
+/* Read the unsmeared time on the TAI timescale.
+ * RETURNS: clock state (see ntp_gettime()).
+ */
+int ntp_gettai(struct timespec *tsp);
+
+/* Make the RTEMS time of day (gettimeofday(), rtems_clock_get_tod(),
+ * ...) follow the disciplined clock: on RTEMS >= 4.11 it is installed
+ * as the timecounter (rtemsNtpCleanup() then refuses to stop the
+ * clock); on older versions the TOD is set whenever it is off by more
+ * than two ticks. Call after rtemsNtpInitialize().
+ * RETURNS 0 on success.
+ */
+int rtemsNtpTodAttach(void);
+
+/* Hardware RTC backend; times are UTC. 'read' may truncate to the
+ * resolution 'res_ns' (0 selects one second); 'write' (optional)
+ * should set the RTC as exactly as it can. Both RETURN 0 on success
+ * and are called from the daemon task.
+ */
+typedef struct RtemsNtpRtcOpsRec_ {
+	int				(*read)(void *arg, struct timespec *ts);
+	int				(*write)(void *arg, const struct timespec *ts);
+	void			*arg;
+	unsigned long	res_ns;
+} RtemsNtpRtcOpsRec;
+
+/* Register the RTC (NULL removes it) before rtemsNtpInitialize().
+ * The clock then starts from the RTC without waiting for the server
+ * and is stepped once the server answers. While synchronized, the RTC
+ * is checked every rtems_ntp_rtc_interval seconds, written back when
+ * off by more than its resolution and its drift is estimated (see
+ * rtemsNtpDumpStats()).
+ * RETURNS 0 on success.
+ */
+int rtemsNtpRtcRegister(const RtemsNtpRtcOpsRec *ops);
+
+/* Print clock statistics */
+long rtemsNtpDumpStats(FILE *f);
+
+/* Print current time to 'fp' (stdout if NULL, nothing if (FILE*)-1)
+ * RETURNS: seconds since the epoch or -1 if the clock is not synchronized.
+ */
+int rtemsNtpPrintTime(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
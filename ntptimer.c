@@ -0,0 +1,367 @@
+/* $Id$ */
+
+/* Timer service on the disciplined clock: callbacks at absolute times
+ * (ns since the epoch).
+ *
+ * Timers are kept in a wheel hashed on the tick interval (of the
+ * disciplined time) they are due in. The ticker wakes the service task
+ * at each tick; timers due before the end of the next interval then
+ * move to a sorted 'tail' list. The task sleeps until the system clock
+ * tick before the head of the tail is due and polls (nano_time_peek())
+ * for the remainder so that timers fire with PCC rather than tick
+ * resolution.
+ *
+ * As the timers are keyed on the disciplined time rather than on a
+ * tick count, slewing needs no special care. If the clock is stepped
+ * back (leap second) the tail is returned to the wheel; if it is
+ * stepped ahead the intervals skipped are processed at once.
+ */
+
+#include <rtems.h>
+#include <stdint.h>
+
+#include "kern.h"
+#include "rtemsdep.h"
+#include "ntpclock.h"
+
+#ifndef NTP_TIMER_LD_WHEEL
+#define NTP_TIMER_LD_WHEEL	8	/* log2 of wheel slots */
+#endif
+#define NTP_TIMER_WHEEL		(1<<NTP_TIMER_LD_WHEEL)
+#define TAIL				(-1)	/* 'slot' of timers in the tail */
+
+#define KILL_SERVICE		RTEMS_EVENT_1
+#define TICK				RTEMS_EVENT_2
+
+static RtemsNtpTimer	wheel[NTP_TIMER_WHEEL];
+static RtemsNtpTimer	tail;			/* sorted by 'when' */
+static int64_t			wheel_tk  = 0;	/* interval (ns); 0 = not running */
+static int64_t			wheel_pos;		/* intervals up to here are done */
+
+static rtems_id			timer_tid   = 0;
+static rtems_id			timer_mutex = 0;
+static rtems_id			timer_kill  = 0;
+static int64_t			sys_tk      = 0;	/* system clock tick (ns) */
+
+unsigned long			rtems_ntp_timer_late = 0;	/* fired > 1 tick late */
+
+#define LOCK()		rtems_semaphore_obtain( timer_mutex, RTEMS_WAIT, RTEMS_NO_TIMEOUT )
+#define UNLOCK()	rtems_semaphore_release( timer_mutex )
+
+/* the tail is polled without the lock */
+#define TAIL_HEAD()	(*(RtemsNtpTimer volatile *)&tail)
+
+static void
+tail_insert(RtemsNtpTimer t)
+{
+RtemsNtpTimer *pp;
+
+	for ( pp = &tail; *pp && (*pp)->when <= t->when; pp = &(*pp)->next )
+		/* nothing else to do */;
+	t->slot = TAIL;
+	t->next = *pp;
+	*pp     = t;
+}
+
+static void
+wheel_insert(RtemsNtpTimer t)
+{
+int64_t iv;
+
+	if ( wheel_tk && (iv = t->when / wheel_tk) > wheel_pos ) {
+		t->slot = (int)(iv & (NTP_TIMER_WHEEL - 1));
+		t->next = wheel[t->slot];
+		wheel[t->slot] = t;
+	} else {
+		/* due before the end of the next interval */
+		tail_insert( t );
+	}
+}
+
+static void
+timer_unlink(RtemsNtpTimer t)
+{
+RtemsNtpTimer *pp;
+
+	for ( pp = TAIL == t->slot ? &tail : &wheel[t->slot]; *pp; pp = &(*pp)->next ) {
+		if ( *pp == t ) {
+			*pp = t->next;
+			break;
+		}
+	}
+	t->next = 0;
+}
+
+/* (Re)start the wheel at interval 'cur' and rehash all timers */
+static void
+wheel_restart(int64_t cur, int64_t tk)
+{
+RtemsNtpTimer all = tail, t;
+int           i;
+
+	for ( i = 0; i < NTP_TIMER_WHEEL; i++ ) {
+		while ( (t = wheel[i]) ) {
+			wheel[i] = t->next;
+			t->next  = all;
+			all      = t;
+		}
+	}
+	tail      = 0;
+	wheel_tk  = tk;
+	wheel_pos = cur;
+	while ( (t = all) ) {
+		all = t->next;
+		wheel_insert( t );
+	}
+}
+
+/* Move the timers due before the end of the next interval to the tail */
+static void
+timer_tick()
+{
+int64_t       tk  = NANOSECOND / hz;
+int64_t       cur = nano_time_peek() / tk;
+int64_t       pos, n;
+RtemsNtpTimer t, *pp;
+
+	LOCK();
+	/* first tick, tick rate changed or clock stepped back */
+	if ( tk != wheel_tk || cur + 1 < wheel_pos )
+		wheel_restart( cur, tk );
+
+	n = cur + 1 - wheel_pos;
+	if ( n > NTP_TIMER_WHEEL )
+		n = NTP_TIMER_WHEEL;	/* stepped ahead; one pass does it */
+
+	for ( pos = wheel_pos + 1; n-- > 0; pos++ ) {
+		pp = &wheel[pos & (NTP_TIMER_WHEEL - 1)];
+		while ( (t = *pp) ) {
+			/* the wheel is hashed; leave later rounds alone */
+			if ( t->when / tk <= cur + 1 ) {
+				*pp = t->next;
+				tail_insert( t );
+			} else {
+				pp = &t->next;
+			}
+		}
+	}
+	if ( cur + 1 > wheel_pos )
+		wheel_pos = cur + 1;
+	UNLOCK();
+}
+
+/* Fire the timers in the tail as they become due; busy-wait for less
+ * than a system clock tick only.
+ * RETURNS the number of system clock ticks to sleep.
+ */
+static rtems_interval
+timer_poll()
+{
+int64_t       tk = NANOSECOND / hz;
+int64_t       now, when;
+RtemsNtpTimer t;
+
+	for (;;) {
+		LOCK();
+		if ( ! (t = tail) ) {
+			UNLOCK();
+			return RTEMS_NO_TIMEOUT;
+		}
+		when = t->when;
+		now  = nano_time_peek();
+		if ( when <= now ) {
+			tail     = t->next;
+			t->next  = 0;
+			t->armed = 0;
+			UNLOCK();
+			if ( now - when > tk )
+				rtems_ntp_timer_late++;
+			t->fn( t->arg );
+			continue;
+		}
+		UNLOCK();
+
+		/* sleep until the system clock tick before 'when' */
+		if ( when - now > sys_tk )
+			return (rtems_interval)((when - now) / sys_tk);
+
+		/* spin; give up early if the head changes (armed/cancelled) */
+		while ( nano_time_peek() < when && TAIL_HEAD() == t )
+			/* poll */;
+	}
+}
+
+static rtems_task
+timerDaemon(rtems_task_argument unused)
+{
+rtems_event_set got;
+rtems_interval  wait = RTEMS_NO_TIMEOUT;
+
+	while ( 1 ) {
+		/* a timeout means the head of the tail is almost due */
+		if ( RTEMS_SUCCESSFUL == rtems_event_receive( KILL_SERVICE | TICK,
+		                                              RTEMS_WAIT | RTEMS_EVENT_ANY,
+		                                              wait,
+		                                              &got )
+		     && (KILL_SERVICE & got) )
+			break;
+		timer_tick();
+		wait = timer_poll();
+	}
+
+	rtems_semaphore_release( timer_kill );
+	rtems_task_suspend( RTEMS_SELF );
+}
+
+/* called by the ticker (possibly from an ISR) */
+static void
+timerTickHook()
+{
+	rtems_event_send( timer_tid, TICK );
+}
+
+void
+rtemsNtpTimerInit(RtemsNtpTimer t, void (*fn)(void *), void *arg)
+{
+	t->next  = 0;
+	t->slot  = TAIL;
+	t->when  = 0;
+	t->fn    = fn;
+	t->arg   = arg;
+	t->armed = 0;
+}
+
+int
+rtemsNtpTimerArm(RtemsNtpTimer t, long long when)
+{
+int wake;
+
+	if ( ! timer_tid )
+		return -1;
+
+	LOCK();
+	if ( t->armed )
+		timer_unlink( t );
+	t->when  = when;
+	t->armed = 1;
+	wheel_insert( t );
+	wake = TAIL == t->slot && t == tail;
+	UNLOCK();
+
+	/* due before the next tick is processed */
+	if ( wake )
+		rtems_event_send( timer_tid, TICK );
+	return 0;
+}
+
+int
+rtemsNtpTimerCancel(RtemsNtpTimer t)
+{
+int rval;
+
+	if ( ! timer_tid )
+		return -1;
+
+	LOCK();
+	if ( (rval = t->armed ? 0 : -1) == 0 ) {
+		timer_unlink( t );
+		t->armed = 0;
+	}
+	UNLOCK();
+	return rval;
+}
+
+int
+rtemsNtpTimerServiceStart(unsigned pri)
+{
+rtems_interval tps;
+
+	if ( timer_tid )
+		return -1;
+
+	if ( ! pri )
+		pri = 150;	/* polls for up to a system clock tick */
+
+	rtems_clock_get( RTEMS_CLOCK_GET_TICKS_PER_SECOND, &tps );
+	if ( ! tps )
+		return -1;
+	sys_tk = NANOSECOND / tps;
+
+	if ( RTEMS_SUCCESSFUL != rtems_semaphore_create(
+								rtems_build_name('N','T','P','w'),
+								1,
+								RTEMS_LOCAL | RTEMS_BINARY_SEMAPHORE |
+								RTEMS_PRIORITY | RTEMS_INHERIT_PRIORITY,
+								0,
+								&timer_mutex ) )
+		goto bail;
+
+	if ( RTEMS_SUCCESSFUL != rtems_semaphore_create(
+								rtems_build_name('N','T','P','k'),
+								0,
+								RTEMS_LOCAL | RTEMS_SIMPLE_BINARY_SEMAPHORE,
+								0,
+								&timer_kill ) )
+		goto bail;
+
+	if ( RTEMS_SUCCESSFUL != rtems_task_create(
+								rtems_build_name('N','T','P','t'),
+								pri,
+								RTEMS_MINIMUM_STACK_SIZE,
+								RTEMS_DEFAULT_MODES,
+								RTEMS_DEFAULT_ATTRIBUTES,
+								&timer_tid ) ) {
+		timer_tid = 0;
+		goto bail;
+	}
+	if ( RTEMS_SUCCESSFUL != rtems_task_start( timer_tid, timerDaemon, 0 ) ) {
+		rtems_task_delete( timer_tid );
+		timer_tid = 0;
+		goto bail;
+	}
+
+	rtems_ntp_tick_hook = timerTickHook;
+	return 0;
+
+bail:
+	if ( timer_kill )
+		rtems_semaphore_delete( timer_kill );
+	if ( timer_mutex )
+		rtems_semaphore_delete( timer_mutex );
+	timer_kill = timer_mutex = 0;
+	return -1;
+}
+
+int
+rtemsNtpTimerServiceStop()
+{
+int i;
+
+	if ( ! timer_tid )
+		return -1;
+
+	rtems_ntp_tick_hook = 0;
+
+	rtems_event_send( timer_tid, KILL_SERVICE );
+	rtems_semaphore_obtain( timer_kill, RTEMS_WAIT, RTEMS_NO_TIMEOUT );
+	rtems_task_delete( timer_tid );
+	timer_tid = 0;
+
+	/* disarm whatever is left */
+	for ( i = 0; i < NTP_TIMER_WHEEL; i++ ) {
+		while ( wheel[i] ) {
+			wheel[i]->armed = 0;
+			wheel[i]        = wheel[i]->next;
+		}
+	}
+	while ( tail ) {
+		tail->armed = 0;
+		tail        = tail->next;
+	}
+	wheel_tk = 0;
+
+	rtems_semaphore_delete( timer_kill );
+	rtems_semaphore_delete( timer_mutex );
+	timer_kill = timer_mutex = 0;
+	return 0;
+}
@@ -113,6 +113,8 @@ unsigned rval = MCF5282_PIT3_PCNTR;
 }
 
 #define HRC_READ() UC5282_HRC_READ()
+/* PIT underflowed but the clock ISR has not run yet */
+#define HRC_PENDING() (MCF5282_PIT3_PCSR & MCF5282_PIT_PCSR_PIF)
 
 #ifdef DECL_SRAM_PITC_PER_TICK /* in config.h */
 #define HRC_PERIOD  (__SRAMBASE.pitc_per_tick)
@@ -126,27 +128,246 @@ unsigned rval = MCF5282_PIT3_PCNTR;
 
 #elif /* ifdef __PPC__ */ defined(__i386__) && defined(USE_RDTSC)
 
-static pcc_t last_tick = 0;
+/* On SMP the TSCs are only usable if they run at a constant rate
+ * regardless of P-/C-states ('invariant TSC'); pccProbe() checks this
+ * with CPUID and otherwise disables the PCC (i.e., the clock falls
+ * back to tick resolution). On UP a TSC that isn't invariant is used
+ * anyway (as before) and pccProbe() says so. Reads are ordered w.r.t.
+ * preceding instructions by using rdtscp, if available, lfence (SSE2)
+ * or cpuid.
+ * On SMP the TSCs of different CPUs may be offset; pccProbe() measures
+ * the offsets relative to CPU 0 which are then subtracted.
+ */
+#include <stdio.h>
+
+#define PCC_X86_NONE	0	/* TSC not usable */
+#define PCC_X86_LFENCE	1	/* lfence; rdtsc */
+#define PCC_X86_RDTSCP	2	/* rdtscp */
+#define PCC_X86_CPUID	3	/* cpuid; rdtsc (no SSE2) */
+
+static int   pcc_x86_mode = PCC_X86_NONE;
+static pcc_t last_tick    = 0;
+
+#ifdef RTEMS_SMP
+#define PCC_X86_MAX_CPUS	32
+static int64_t pcc_x86_skew[PCC_X86_MAX_CPUS];
+#endif
+
+static inline void
+x86_cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+	/* preserve %ebx (PIC register) */
+	__asm__ __volatile__ ("xchgl %%ebx, %1; cpuid; xchgl %%ebx, %1"
+	                      : "=a"(*a), "=r"(*b), "=c"(*c), "=d"(*d)
+	                      : "0"(leaf), "2"(0));
+}
 
 static inline pcc_t rdtsc()
 {
-uint32_t hi, lo;
-	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+uint32_t hi, lo, a, b, c, d;
+	if ( PCC_X86_RDTSCP == pcc_x86_mode ) {
+		__asm__ __volatile__ ("rdtscp" : "=a" (lo), "=d" (hi) : : "ecx");
+	} else if ( PCC_X86_CPUID == pcc_x86_mode ) {
+		x86_cpuid( 0, &a, &b, &c, &d );
+		__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	} else {
+		__asm__ __volatile__ ("lfence; rdtsc" : "=a" (lo), "=d" (hi));
+	}
 	return ((((pcc_t)hi)<<32) | lo);
 }
 
-static pcc_t getPcc()
+#ifdef RTEMS_SMP
+/* TSC of this CPU, corrected for its offset from CPU 0 (CPUs beyond
+ * PCC_X86_MAX_CPUS aren't measured and assumed to be in step).
+ * Interrupts are masked so we can't migrate between reading the CPU
+ * number and the TSC.
+ */
+static inline pcc_t rdtsc_cpu0()
 {
-	return rdtsc() - last_tick;
+rtems_interrupt_level l;
+pcc_t                 rval;
+uint32_t              cpu;
+	rtems_interrupt_local_disable(l);
+	cpu  = rtems_get_current_processor();
+	rval = rdtsc();
+	if ( cpu < PCC_X86_MAX_CPUS )
+		rval -= pcc_x86_skew[cpu];
+	rtems_interrupt_local_enable(l);
+	return rval;
+}
+#else
+#define rdtsc_cpu0()	rdtsc()
+#endif
+
+static inline pcc_t getPcc()
+{
+	if ( PCC_X86_NONE == pcc_x86_mode )
+		return 0;
+	return rdtsc_cpu0() - last_tick;
 }
 
 static inline pcc_t setPccBase()
 {
 pcc_t old = last_tick;
-	last_tick = rdtsc();
+	if ( PCC_X86_NONE == pcc_x86_mode )
+		return 0;
+	last_tick = rdtsc_cpu0();
 	return old ? (last_tick - old) : 0;
 }
 
+#ifdef RTEMS_SMP
+/* Ping-pong between CPU 0 and CPU 'pcc_x86_pp_cpu'; the offset is
+ * estimated from the exchange with the shortest round trip.
+ */
+#define PCC_X86_PP_ROUNDS	64
+
+static volatile int   pcc_x86_pp_state;
+static volatile pcc_t pcc_x86_pp_slave;
+static rtems_id       pcc_x86_pp_done;
+
+static inline rtems_task
+pccX86PingPong(rtems_task_argument unused)
+{
+int i;
+	for ( i=0; i<PCC_X86_PP_ROUNDS; i++ ) {
+		while ( 1 != pcc_x86_pp_state )
+			/* spin */;
+		pcc_x86_pp_slave = rdtsc();
+		pcc_x86_pp_state = 2;
+	}
+	rtems_semaphore_release( pcc_x86_pp_done );
+	rtems_task_suspend( RTEMS_SELF );
+}
+
+static inline int
+pccX86MeasureSkew()
+{
+uint32_t          ncpus = rtems_get_processor_count();
+uint32_t          cpu;
+int               i;
+rtems_id          tid;
+rtems_task_priority pri;
+cpu_set_t         set, oset;
+pcc_t             t0, t1, best, ts;
+int64_t           off;
+
+	if ( ncpus > PCC_X86_MAX_CPUS )
+		ncpus = PCC_X86_MAX_CPUS;
+	if ( ncpus < 2 )
+		return 0;
+
+	if ( RTEMS_SUCCESSFUL != rtems_semaphore_create(
+								rtems_build_name('N','T','P','s'),
+								0,
+								RTEMS_LOCAL | RTEMS_SIMPLE_BINARY_SEMAPHORE,
+								0,
+								&pcc_x86_pp_done) )
+		return -1;
+
+	rtems_task_get_affinity( RTEMS_SELF, sizeof(oset), &oset );
+	rtems_task_set_priority( RTEMS_SELF, RTEMS_CURRENT_PRIORITY, &pri );
+	CPU_ZERO( &set );
+	CPU_SET( 0, &set );
+	rtems_task_set_affinity( RTEMS_SELF, sizeof(set), &set );
+
+	for ( cpu = 1; cpu < ncpus; cpu++ ) {
+		if ( RTEMS_SUCCESSFUL != rtems_task_create(
+								rtems_build_name('N','T','P','p'),
+								pri,
+								RTEMS_MINIMUM_STACK_SIZE,
+								RTEMS_DEFAULT_MODES,
+								RTEMS_DEFAULT_ATTRIBUTES,
+								&tid) )
+			break;
+		CPU_ZERO( &set );
+		CPU_SET( cpu, &set );
+		rtems_task_set_affinity( tid, sizeof(set), &set );
+		pcc_x86_pp_state = 0;
+		rtems_task_start( tid, pccX86PingPong, 0 );
+
+		best = (pcc_t)-1;
+		off  = 0;
+		for ( i=0; i<PCC_X86_PP_ROUNDS; i++ ) {
+			t0 = rdtsc();
+			pcc_x86_pp_state = 1;
+			while ( 2 != pcc_x86_pp_state )
+				/* spin */;
+			t1 = rdtsc();
+			ts = pcc_x86_pp_slave;
+			if ( t1 - t0 < best ) {
+				best = t1 - t0;
+				off  = (int64_t)(ts - t0 - best/2);
+			}
+			pcc_x86_pp_state = 0;
+		}
+		pcc_x86_skew[cpu] = off;
+
+		rtems_semaphore_obtain( pcc_x86_pp_done, RTEMS_WAIT, RTEMS_NO_TIMEOUT );
+		rtems_task_delete( tid );
+	}
+
+	rtems_task_set_affinity( RTEMS_SELF, sizeof(oset), &oset );
+	rtems_semaphore_delete( pcc_x86_pp_done );
+	return cpu < ncpus ? -1 : 0;
+}
+#endif
+
+/* Check whether the TSC can be used; RETURNS 0 if so */
+#define HAVE_PCC_PROBE
+static inline int
+pccProbe()
+{
+uint32_t a, b, c, d, maxext;
+int      sse2, invariant = 0, rdtscp = 0;
+
+	pcc_x86_mode = PCC_X86_NONE;
+
+	x86_cpuid( 0, &a, &b, &c, &d );
+	if ( a < 1 )
+		return -1;
+	x86_cpuid( 1, &a, &b, &c, &d );
+	if ( ! (d & (1<<4)) )			/* TSC */
+		return -1;
+	sse2 = d & (1<<26);				/* lfence */
+
+	x86_cpuid( 0x80000000, &maxext, &b, &c, &d );
+	if ( maxext >= 0x80000001 ) {
+		x86_cpuid( 0x80000001, &a, &b, &c, &d );
+		rdtscp = d & (1<<27);
+	}
+	if ( maxext >= 0x80000007 ) {
+		x86_cpuid( 0x80000007, &a, &b, &c, &d );
+		invariant = d & (1<<8);
+	}
+
+#ifdef RTEMS_SMP
+	/* the CPUs' TSCs must keep in step */
+	if ( ! invariant ) {
+		fprintf(stderr,"PCC: TSC not invariant; unusable on SMP\n");
+		return -1;
+	}
+#endif
+
+	if ( rdtscp )
+		pcc_x86_mode = PCC_X86_RDTSCP;
+	else if ( sse2 )
+		pcc_x86_mode = PCC_X86_LFENCE;
+	else
+		pcc_x86_mode = PCC_X86_CPUID;
+
+	fprintf(stderr,"PCC: TSC (%s)%s\n",
+	        rdtscp ? "rdtscp" : sse2 ? "lfence; rdtsc" : "cpuid; rdtsc",
+	        invariant ? "" : "; not invariant -- rate may change with power states");
+
+#ifdef RTEMS_SMP
+	if ( pccX86MeasureSkew() ) {
+		pcc_x86_mode = PCC_X86_NONE;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
 #else /* ifdef __PPC__ */
 
 #warning No High Resolution Clock Implementation for this CPU, please add to pcc.h (DISABLED)
@@ -171,21 +392,44 @@ static uint32_t tick_base;
 
 static inline pcc_t getPcc()
 {
-unsigned        flags;
 pcc_t           pcc;
 unsigned		rtemsTicks;
+#ifdef HRC_PENDING
+unsigned		t0, pending;
+
+	/* Don't mask interrupts; retry if the clock ISR ran while
+	 * we were reading. If the counter has underflowed but the
+	 * ISR is still pending then the tick count is one short.
+	 */
+	do {
+		t0         = Clock_driver_ticks;
+		pcc        = HRC_READ();
+		pending    = HRC_PENDING();
+		rtemsTicks = Clock_driver_ticks;
+	} while ( t0 != rtemsTicks );
+
+	pcc = HRC_PERIOD - pcc;
+
+	/* the flag may have been raised after reading the counter
+	 * (which then is close to the end of the period)
+	 */
+	if ( pending && pcc < HRC_PERIOD/2 )
+		rtemsTicks++;
+#else
+unsigned        flags;
 
 	/* reading the PCC (the decrementer register) and
 	 * the current system tick counter must be
-	 * atomical...
+	 * atomical... (only used on UP; SMP reads getPccFree())
 	 */
-	rtems_interrupt_disable( flags );
+	ntp_local_disable( flags );
 	pcc = HRC_READ();
 	rtemsTicks   = Clock_driver_ticks;
-	rtems_interrupt_enable( flags );
+	ntp_local_enable( flags );
 
 	/* even correct if the decrementer has underflown */
 	pcc = HRC_PERIOD - pcc;
+#endif
 
 	/* account for the number of ticks expired since setPccBase()
 	 * was called for the last time
@@ -214,5 +458,42 @@ static inline pcc_t setPccBase() 	{ return 0; }
 
 #endif
 
+/* Probe the PCC at startup (if the implementation supports this);
+ * RETURNS 0 if the PCC is usable.
+ */
+#ifndef HAVE_PCC_PROBE
+static inline int pccProbe()		{ return 0; }
+#endif
+
+#ifdef RTEMS_SMP
+/* On SMP, micro.c interpolates separately on each CPU and needs the
+ * raw, free-running PCC of the executing CPU (rpcc()); the per-CPU
+ * base and rate are maintained by microset(). Readings are compared
+ * across CPUs (epoch ring, event queues) so the TSC is corrected for
+ * the CPU's offset.
+ */
+#if defined(__i386__) && defined(USE_RDTSC)
+static inline pcc_t getPccFree()
+{
+	return PCC_X86_NONE == pcc_x86_mode ? 0 : rdtsc_cpu0();
+}
+#elif defined(__PPC__)
+static inline pcc_t getPccFree()
+{
+unsigned tb;
+	asm volatile("mftb %0":"=r"(tb));
+	return tb;
+}
+#else
+#error "No free-running PCC for SMP on this CPU, please add to pcc.h"
+#endif
+
+long long
+rpcc();
+
+void
+microset_from_saved(pcc_t saved_pcc, struct timespec *pt);
+#endif
+
 
 #endif
@@ -0,0 +1,193 @@
+/* $Id$ */
+#ifndef NTP_PCC_LSQ_H
+#define NTP_PCC_LSQ_H
+
+/* Sliding-window least-squares estimate of the PCC rate.
+ *
+ * Normally, the interpolation scale (ns per PCC click) is taken from
+ * the last tick interval alone, so that a single late tick (where the
+ * PCC is read by software) skews interpolation for the entire next
+ * interval. Instead, the PCC readings at the last PCCLSQ_N ticks are
+ * fitted against kernel time. Since the noise is in the PCC readings
+ * the regression is of PCC on time. A reading which deviates from the
+ * fit by more than a fraction of an interval is rejected.
+ *
+ * Integer arithmetic only (the ticker is not a FP task); the sums are
+ * updated in O(1) per tick. Coordinates are relative to the newest
+ * sample and scaled down to < 2^24 so that all sums fit in 64 bits.
+ */
+
+#include <stdint.h>
+
+#ifndef PCCLSQ_LD_N
+#define PCCLSQ_LD_N			4	/* log2 of window length (ticks) */
+#endif
+#define PCCLSQ_N			(1<<PCCLSQ_LD_N)
+#define PCCLSQ_LD_REJECT	3	/* reject if off by > interval/8 */
+#define PCCLSQ_MAX_REJECT	4	/* restart after as many rejects in a row */
+#define PCCLSQ_LD_LIMIT		24	/* scaled coordinates < 2^24 */
+
+typedef struct PccLsqRec_ {
+	int64_t		X, Y;			/* cumulative clicks/ns (unscaled) */
+	int64_t		xo, yo;			/* origin (newest accepted; scaled) */
+	int64_t		xs[PCCLSQ_N];	/* accepted samples (scaled) */
+	int64_t		ys[PCCLSQ_N];
+	int64_t		sx, sy, sxy, syy;	/* sums relative to origin */
+	int64_t		dx_nom, dy_nom;	/* interval at (re)start */
+	int			xshift, yshift;
+	int			n, head;
+	int			rejects;		/* consecutive rejects */
+	unsigned long nrejected;	/* statistics */
+	unsigned long num, den;		/* current estimate (ns/clicks) */
+} PccLsqRec, *PccLsq;
+
+static inline int
+pcclsq_bits(int64_t v)
+{
+int rval = 0;
+	while ( v ) {
+		v >>= 1;
+		rval++;
+	}
+	return rval;
+}
+
+/* start over with a single interval */
+static inline void
+pcclsq_restart(PccLsq e, int64_t dx, int64_t dy)
+{
+int sh;
+	e->n       = 0;
+	e->head    = 0;
+	e->rejects = 0;
+	e->sx = e->sy = e->sxy = e->syy = 0;
+	e->dx_nom  = dx;
+	e->dy_nom  = dy;
+	/* leave room for PCCLSQ_N + PCCLSQ_MAX_REJECT intervals */
+	sh = pcclsq_bits(dx) + PCCLSQ_LD_N + 1 - PCCLSQ_LD_LIMIT;
+	e->xshift  = sh > 0 ? sh : 0;
+	sh = pcclsq_bits(dy) + PCCLSQ_LD_N + 1 - PCCLSQ_LD_LIMIT;
+	e->yshift  = sh > 0 ? sh : 0;
+	/* the interval's start is the first sample */
+	e->X       = 0;
+	e->Y       = 0;
+	e->xo      = 0;
+	e->yo      = 0;
+	e->xs[0]   = 0;
+	e->ys[0]   = 0;
+	e->n       = 1;
+	e->head    = 1;
+	e->num     = dy;
+	e->den     = dx;
+}
+
+/* Compute num/den from the sums; RETURNS 0 on success */
+static inline int
+pcclsq_fit(PccLsq e)
+{
+int64_t n = e->n, nm, dn;
+int     d;
+
+	nm = n * e->syy - e->sy * e->sy;
+	dn = n * e->sxy - e->sx * e->sy;
+	if ( nm <= 0 || dn <= 0 )
+		return -1;
+
+	/* undo scaling: ns/click = nm * 2^(2 yshift) / (dn * 2^(xshift + yshift)) */
+	d = e->yshift - e->xshift;
+	if ( d > 0 )
+		dn >>= d;
+	else if ( d < 0 )
+		nm >>= -d;
+
+	while ( (nm >> 31) || (dn >> 32) ) {
+		nm >>= 1;
+		dn >>= 1;
+	}
+	if ( 0 == nm || 0 == dn )
+		return -1;
+	e->num = nm;
+	e->den = dn;
+	return 0;
+}
+
+/* Add the interval of 'dx' PCC clicks and 'dy' ns ending at the current
+ * tick. RETURNS 0 and the estimated scale in *pnum / *pden if the fit
+ * can be used, nonzero otherwise (the caller should then use dy/dx).
+ */
+static inline int
+pcclsq_update(PccLsq e, int64_t dx, int64_t dy, unsigned long *pnum, unsigned long *pden)
+{
+int64_t x, y, a, c, n, pred, tol;
+
+	if ( dx <= 0 || dy <= 0 )
+		return -1;
+
+	/* clock stepped or tick rate changed; start over */
+	if ( 0 == e->dy_nom || dy > 2 * e->dy_nom || 2 * dy < e->dy_nom ) {
+		pcclsq_restart(e, dx, dy);
+		return -1;
+	}
+
+	e->X += dx;
+	e->Y += dy;
+
+	/* reject readings off the fitted line; predict in scaled
+	 * coordinates (y - yo < 2^24, den < 2^32: no overflow) and
+	 * scale the result up
+	 */
+	if ( e->n >= PCCLSQ_N/2 ) {
+		pred = ((e->Y >> e->yshift) - e->yo) * (int64_t)e->den / (int64_t)e->num;
+		pred = (pred << e->yshift) + (e->xo << e->xshift);
+		tol  = e->dx_nom >> PCCLSQ_LD_REJECT;
+		if ( e->X - pred > tol || pred - e->X > tol ) {
+			e->nrejected++;
+			if ( ++e->rejects > PCCLSQ_MAX_REJECT ) {
+				pcclsq_restart(e, dx, dy);
+				return -1;
+			}
+			*pnum = e->num;
+			*pden = e->den;
+			return 0;
+		}
+	}
+	e->rejects = 0;
+
+	x = e->X >> e->xshift;
+	y = e->Y >> e->yshift;
+
+	/* move origin to the new sample which thus contributes nothing */
+	a = x - e->xo;
+	c = y - e->yo;
+	n = e->n;
+	e->sxy += n * a * c - a * e->sy - c * e->sx;
+	e->syy += n * c * c - 2 * c * e->sy;
+	e->sx  -= n * a;
+	e->sy  -= n * c;
+	e->xo   = x;
+	e->yo   = y;
+
+	if ( e->n == PCCLSQ_N ) {
+		/* drop the oldest sample */
+		a = e->xs[e->head] - x;
+		c = e->ys[e->head] - y;
+		e->sx  -= a;
+		e->sy  -= c;
+		e->sxy -= a * c;
+		e->syy -= c * c;
+	} else {
+		e->n++;
+	}
+	e->xs[e->head] = x;
+	e->ys[e->head] = y;
+	e->head = (e->head + 1) & (PCCLSQ_N - 1);
+
+	if ( e->n < PCCLSQ_N/2 || pcclsq_fit(e) )
+		return -1;
+
+	*pnum = e->num;
+	*pden = e->den;
+	return 0;
+}
+
+#endif
@@ -41,8 +41,12 @@ static void clock_isr(void *arg)
 	rtems_ntp_isr_snippet();
 #endif
 
+#ifdef USE_ISR_TICKER
+	rtemsNtpTickerIsr();
+#else
 	if ( RTEMS_SUCCESSFUL != rtems_event_send(rtems_ntp_ticker_id, PICTIMER_SYNC_EVENT) )
 		rtems_ntp_pictimer_irqs_missed++;
+#endif
 }
 
 #ifndef USE_METHOD_B_FOR_DEMO
@@ -35,11 +35,19 @@
 #include "rtemsdep.h"
 #include "timex.h"
 #include "pcc.h"
+#include "ntpclock.h"
+#ifdef USE_PCC_LSQ
+#include "pcclsq.h"
+#endif
 
 #ifdef USE_PICTIMER
 #include "pictimer.h"
 #endif
 
+#if RTEMS_VERSION_AT_LEAST(4,10,99) && ! defined(_USED_FROM_SIMULATOR_)
+#include <rtems/timecounter.h>
+#endif
+
 #endif
 
 
@@ -55,11 +63,16 @@
 #define DAEMON_SYNC_INTERVAL_SECS	64	/* default sync interval */
 
 #define KILL_DAEMON					RTEMS_EVENT_1
+#define SECOND_OVERFLOW				RTEMS_EVENT_3	/* USE_ISR_TICKER */
+#define MICROSET					RTEMS_EVENT_4	/* RTEMS_SMP */
 
 #ifdef USE_PICTIMER
 #if KILL_DAEMON == PICTIMER_SYNC_EVENT
 #error PICTIMER_SYNC_EVENT collides with KILL_DAEMON event
 #endif
+#if SECOND_OVERFLOW == PICTIMER_SYNC_EVENT
+#error PICTIMER_SYNC_EVENT collides with SECOND_OVERFLOW event
+#endif
 #endif
 
 #define PPM_SCALE					(1<<16)
@@ -70,10 +83,46 @@
  */
 #define MAX_FAILED_SYNCS			10
 
+/* Holdover: while synchronized, the daemon learns a linear frequency
+ * aging model from the frequency history. When the server cannot be
+ * reached, the frequency is corrected according to the model and the
+ * maximum error grows by the model uncertainty rather than by MAXFREQ.
+ */
+#define HOLDOVER_DECAY				(1./64.)	/* weight decay per sample */
+#define HOLDOVER_MIN_SAMPLES		16			/* before the model is trusted */
+#define HOLDOVER_MARGIN				3.			/* safety factor for error growth */
+#define HOLDOVER_MIN_TOLERANCE		10			/* min. maxerror growth (ns/s) */
+
+/* Default length of the boot-time PCC calibration (ms); 0 disables it */
+#define PCC_CALIBRATION_MS			200
+
+/* Default interval (s) between checks of the hardware RTC (while
+ * synchronized); it is written when off by more than its resolution.
+ */
+#define RTC_INTERVAL_SECS			660
+
+/* USE_ADJTIME_QUEUE: changes to the discipline state (ntp_adjtime(),
+ * hardupdate() etc.) are handed to the ticker which applies them at
+ * a tick boundary; the ticker then is the only writer and never takes
+ * the mutex. Not needed (and not supported) with USE_ISR_TICKER.
+ */
+#ifdef _USED_FROM_SIMULATOR_
+#undef USE_ADJTIME_QUEUE
+#endif
+#if defined(USE_ADJTIME_QUEUE) && defined(USE_ISR_TICKER)
+#error USE_ADJTIME_QUEUE cannot be used with USE_ISR_TICKER
+#endif
+
+/* USE_PCC_SLEW: the interpolation doesn't jump to TIMEVAR at each tick
+ * but converges to it (see ticker_slew()).
+ */
+
 
 /* =========== PUBLIC GLOBALS ======================== */
 volatile unsigned      rtems_ntp_debug = 0;
 FILE		  		   *rtems_ntp_debug_file = 0;
+unsigned               rtems_ntp_pcc_calibration_ms = PCC_CALIBRATION_MS;
+unsigned               rtems_ntp_rtc_interval       = RTC_INTERVAL_SECS;
 
 /* =========== GLOBAL VARIABLES ====================== */
 
@@ -83,7 +132,11 @@ struct timespec TIMEVAR = {0, 0};	/* kernel nanosecond clock */
 struct timeval TIMEVAR  = {0, 0};	/* kernel microsecond clock */
 #endif
 
+#ifndef RTEMS_SMP
 int microset_flag[NCPUS] = {0,};	/* microset() initialization filag */
+#else
+volatile unsigned long rtems_ntp_timevar_seq = 0;
+#endif
 int hz                   = 0;
 
 #ifndef _USED_FROM_SIMULATOR_
@@ -91,18 +144,54 @@ int hz                   = 0;
        rtems_id rtems_ntp_daemon_id = 0;
 static rtems_id kill_sem;
 static rtems_id mutex_id  = 0;
-#ifndef USE_PICTIMER
+#if !defined(USE_PICTIMER) && !defined(USE_ISR_TICKER)
 static volatile int tickerRunning = 0;
 #endif
+#if defined(USE_ISR_TICKER) && !defined(USE_PICTIMER)
+static rtems_id tick_timer_id = 0;
+#endif
+#ifndef USE_PICTIMER
+/* ticker runs every 'rate_divisor' system clock ticks */
+static volatile unsigned rate_divisor     = RATE_DIVISOR;
+static volatile unsigned rate_divisor_req = 0;	/* pending change */
+#ifndef USE_ISR_TICKER
+static unsigned          rate_divisor_hz  = 0;	/* pending change of hz */
+#endif
+static rtems_interval    ticks_per_second = 0;
+#endif
 #ifdef USE_METHOD_B_FOR_DEMO
 static rtems_id sysclk_irq_id = 0;
 #endif
+#ifdef RTEMS_SMP
+static rtems_id microset_id[NCPUS];	/* per-CPU microset() tasks */
+static uint32_t microset_ncpus = 0;
+
+extern int64_t pcc_numer[NCPUS];	/* micro.c */
+extern int64_t pcc_denom[NCPUS];
+#endif
 
 int    rtems_ntp_daemon_sd          = 0;
 static int our_sd                   = 0;
 
 /* Mutex Primitives (compat with ktime.c / micro.c) */
 
+#ifdef USE_ISR_TICKER
+/* The clock is updated from interrupt context; mask interrupts */
+int
+splclock()
+{
+rtems_interrupt_level level;
+	rtems_interrupt_disable( level );
+	return (int)level;
+}
+
+int
+splx(int level)
+{
+	rtems_interrupt_enable( (rtems_interrupt_level)level );
+	return 0;
+}
+#else
 int
 splclock()
 {
@@ -117,6 +206,24 @@ splx(int level)
 		rtems_semaphore_release( mutex_id );
 	return 0;
 }
+#endif
+
+#ifdef RTEMS_SMP
+/* splsched(), splextreme(): keep the caller on this CPU */
+int
+rtemsNtpSplLocal()
+{
+rtems_interrupt_level level;
+	rtems_interrupt_local_disable( level );
+	return (int)level;
+}
+
+void
+rtemsNtpSplxLocal(int level)
+{
+	rtems_interrupt_local_enable( (rtems_interrupt_level)level );
+}
+#endif
 
 /*
  * RTEMS base: 1988, January 1
@@ -148,11 +255,26 @@ static inline long long llabs(long long n)
 
 static unsigned long pcc_numerator;
 static unsigned long pcc_denominator = 0;
-#ifdef NTP_NANO
-static struct timespec	nanobase;
-#else
-static struct timeval	nanobase;
+static int           pcc_seeded      = 0;	/* keep calibrated scale on 1st tick */
+#ifndef _USED_FROM_SIMULATOR_
+static unsigned long long pcc_cal_clicks = 0;	/* calibration result */
+static unsigned long long pcc_cal_ns     = 0;
+static unsigned long long pcc_raw_hz     = 0;	/* calibrated PCC rate */
 #endif
+#ifdef USE_PCC_LSQ
+static PccLsqRec     pcc_lsq;	/* PCC rate estimator */
+#endif
+/* times in ns since the epoch */
+static int64_t			nanobase;	/* interpolation base */
+#ifdef USE_PCC_SLEW
+static int64_t			tickbase;	/* TIMEVAR at the last rebase */
+#endif
+static int64_t			monobase;	/* nanobase less the leap steps */
+static unsigned long long	rawclicks;	/* PCC clicks until the last rebase */
+static int64_t			clock_stepped = 0;	/* sum of clock_step()s (ns) */
+
+/* the monotonic timescale isn't stepped (leap seconds, clock_step()) */
+#define MONO_OFFSET()	((int64_t)time_leapstep * NANOSECOND + clock_stepped)
 
 /* Convert poll seconds to PLL time constant. According to the
  * documentation the polling interval tracks the time-constant 
@@ -173,29 +295,156 @@ unsigned rval,probe;
 	return ( probe - secs < secs - (probe>>1) ) ? rval : rval - 1;
 }
 
-unsigned long long lasttime = 0;
+/* ticker bumps this before and after rebasing; odd while in progress */
+static volatile unsigned long nanoseq = 0;
 
-long
-nano_time(struct timespec *tp)
-{
-unsigned long long pccl, thistime;
+#define COMPILER_BARRIER()	__asm__ __volatile__("":::"memory")
 
-	pccl = getPcc();
+/* orders the accesses around a sequence count; on SMP the other side
+ * may be on another CPU
+ */
+#ifdef RTEMS_SMP
+#define SEQ_BARRIER()		__sync_synchronize()
+#else
+#define SEQ_BARRIER()		COMPILER_BARRIER()
+#endif
 
-#ifdef NTP_NANO
-	*tp = nanobase;
+/* Free-running PCC readings are masked to the counter width on SMP;
+ * on UP they are the ticker's 64-bit click count.
+ */
+#if defined(RTEMS_SMP) && PCC_WIDTH < 64
+#define PCC_RAW_MASK	((1ULL << PCC_WIDTH) - 1)
 #else
-	tp->tv_sec   = nanobase.tv_sec;
-	tp->tv_nsec  = nanobase.tv_usec * 1000;
+#define PCC_RAW_MASK	(~0ULL)
 #endif
 
+/* Signed difference of two free-running PCC readings */
+static inline int64_t
+pcc_diff(unsigned long long a, unsigned long long b)
+{
+int64_t d = a - b;
+#if defined(RTEMS_SMP) && PCC_WIDTH < 64
+	/* the counter wraps at PCC_WIDTH bits */
+	d = (int64_t)((unsigned long long)d << (64 - PCC_WIDTH)) >> (64 - PCC_WIDTH);
+#endif
+	return d;
+}
+
+/* Ring of recent interpolation epochs so that PCC readings taken a
+ * few ticks ago can be converted with the base and scale that were
+ * in effect then. Written by the ticker only.
+ */
+#ifndef PCC_EPOCHS
+#define PCC_EPOCHS	16	/* power of two */
+#endif
+
+typedef struct PccEpochHistRec_ {
+	unsigned long long	pcc;	/* free-running PCC at the base */
+	int64_t				ns;		/* time at the base */
+	int64_t				numer;	/* ns per click = numer / denom */
+	int64_t				denom;
+} PccEpochHistRec;
+
+static PccEpochHistRec			epochs[PCC_EPOCHS];
+static unsigned					epoch_head = 0;	/* epochs recorded */
+static volatile unsigned long	epochseq   = 0;	/* odd while recording */
+
+static inline void
+epoch_record(unsigned long long pcc, int64_t ns, int64_t numer, int64_t denom)
+{
+PccEpochHistRec *h = &epochs[epoch_head & (PCC_EPOCHS - 1)];
+
+	epochseq++;
+	SEQ_BARRIER();
+	h->pcc   = pcc;
+	h->ns    = ns;
+	h->numer = numer;
+	h->denom = denom;
+	epoch_head++;
+	SEQ_BARRIER();
+	epochseq++;
+}
+
+#ifdef RTEMS_SMP
+/* Each CPU interpolates separately; nano_time() is provided by micro.c
+ * and the per-CPU bases are refreshed by microset() tasks pinned to
+ * the CPUs (in lieu of an interprocessor interrupt).
+ */
+
+/* micro.c's PCC */
+long long
+rpcc()
+{
+	return getPccFree();
+}
+
+/* micro.c keeps its clamp per CPU (under splsched()); safe as is */
+int64_t
+nano_time_peek()
+{
+	return nano_time_ns();
+}
+
+#else
+
+int64_t lasttime = 0;
+
+/* Interpolate without side effects (safe from an ISR).
+ * RETURNS the ns past the base or -1 if the PCC scale isn't known;
+ * the base and the base on the monotonic timescale are stored in
+ * *pbase and *pmono.
+ */
+static inline int64_t
+nano_time_snap(int64_t *pbase, int64_t *pmono)
+{
+unsigned long long pccl;
+unsigned long      numerator, denominator;
+unsigned long      seq;
+
+	/* The ticker may rebase while we are reading (it doesn't take the
+	 * mutex with USE_ADJTIME_QUEUE nor do lock-free readers); read a
+	 * consistent snapshot of the interpolation parameters.
+	 */
+	do {
+		seq = nanoseq;
+		COMPILER_BARRIER();
+
+	pccl = getPcc();
+
+	*pbase      = nanobase;
+	*pmono      = monobase;
+	numerator   = pcc_numerator;
+	denominator = pcc_denominator;
+
+		COMPILER_BARRIER();
+	} while ( (seq & 1) || seq != nanoseq );
+
+	if ( ! denominator )
+		return -1;
+
 	/* convert to nanoseconds */
-	if ( pcc_denominator ) {
-		pccl *= pcc_numerator;
-		pccl /= pcc_denominator;
-		
-		thistime  = (unsigned long)tp->tv_sec;
-		thistime  = thistime * NANOSECOND + tp->tv_nsec + pccl;
+	pccl *= numerator;
+	pccl /= denominator;
+	return (int64_t)pccl;
+}
+
+/* RETURNS the time in ns since the epoch and the interpolated
+ * nanoseconds past the base in *ppcc. If 'pmono' is not NULL the
+ * same reading on the monotonic timescale (not clamped) is stored
+ * there.
+ */
+static inline int64_t
+nano_time_interp(long *ppcc, int64_t *pmono)
+{
+int64_t pccl, thistime, mono;
+
+	pccl  = nano_time_snap( &thistime, &mono );
+	*ppcc = 0;
+
+	if ( pccl >= 0 ) {
+		thistime += pccl;
+		mono     += pccl;
+		*ppcc     = (long)pccl;
 
 		/* prevent the clock from running backwards
 		 * (small backjumps may appear if a clock tick
@@ -205,45 +454,482 @@ unsigned long long pccl, thistime;
 		if ( thistime <= lasttime )
 			thistime = lasttime + 1;
 		lasttime = thistime;
-
-		tp->tv_sec  = thistime / NANOSECOND;
-		tp->tv_nsec = thistime % NANOSECOND;
 	}
 
-	return (long)pccl;
+	if ( pmono )
+		*pmono = mono;
+
+	return thistime;
+}
+
+int64_t
+nano_time_ns()
+{
+long pccl;
+	return nano_time_interp(&pccl, 0);
+}
+
+/* Same without the clamp (which updates 'lasttime'); lock-free */
+int64_t
+nano_time_peek()
+{
+int64_t base, mono, pccl;
+
+	pccl = nano_time_snap( &base, &mono );
+	return pccl > 0 ? base + pccl : base;
 }
 
+long
+nano_time(struct timespec *tp)
+{
+long    pccl;
+int64_t t = nano_time_interp(&pccl, 0);
+
+	tp->tv_sec  = t / NANOSECOND;
+	tp->tv_nsec = t % NANOSECOND;
+	return pccl;
+}
+
+/* Interpolation base on the PCC click count (see rawclicks) and scale
+ * (ns per click as *numerp / *denomp).
+ * RETURNS 0 on success, nonzero if the scale isn't known yet.
+ */
+int
+nano_time_scale(int64_t *pccp, int64_t *nsp, int64_t *numerp, int64_t *denomp)
+{
+unsigned long seq;
+
+	do {
+		seq = nanoseq;
+		COMPILER_BARRIER();
+		*pccp   = rawclicks;
+		*nsp    = nanobase;
+		*numerp = pcc_numerator;
+		*denomp = pcc_denominator;
+		COMPILER_BARRIER();
+	} while ( (seq & 1) || seq != nanoseq );
+
+	return 0 == *denomp;
+}
+
+#endif /* RTEMS_SMP */
+
 unsigned long tsillticks=0;
 
+#ifdef USE_PCC_SLEW
+/* Rather than jumping to TIMEVAR at each tick, continue from where the
+ * interpolation has got to and fold the difference into the scale so
+ * that TIMEVAR is met at the next tick. The time thus is continuous
+ * and advances at the disciplined rate (including the slew) within
+ * each tick. Large differences (leap second, missed ticks) are
+ * stepped.
+ * 'clicks' and 'adv' (ns) span the last interval, 'onum'/'oden' is
+ * the scale used during it and pcc_numerator/pcc_denominator the new
+ * rate estimate.
+ * RETURNS 0 if nanobase and the scale were updated, nonzero if the
+ * caller must step.
+ */
+static inline int
+ticker_slew(unsigned long long clicks, long long adv, unsigned long onum, unsigned long oden)
+{
+unsigned long long d, x, n;
+long long          err;
+
+	if ( 0 == oden || 0 == pcc_numerator || 0 == clicks || adv <= 0 )
+		return -1;
+
+	/* interpolated time elapsed since nanobase */
+	d   = clicks * onum / oden;
+	err = TIMEVAR_NS(TIMEVAR) - nanobase - (long long)d;
+
+	if ( err >= adv/2 || err <= -adv/2 )
+		return -1;
+
+	/* expected clicks and ns until the next tick */
+	x = (unsigned long long)adv * pcc_denominator / pcc_numerator;
+	n = adv + err;
+	while ( (x >> 32) || (n >> 31) ) {
+		x >>= 1;
+		n >>= 1;
+	}
+	if ( 0 == x || 0 == n )
+		return -1;
+
+	nanobase += d;
+	pcc_numerator   = n;
+	pcc_denominator = x;
+	return 0;
+}
+#endif
+
+/* Rebase the interpolation on the just updated TIMEVAR;
+ * must be called with interrupts disabled.
+ */
+static inline void
+ticker_rebase()
+{
+#ifdef USE_PCC_SLEW
+unsigned long      onum = pcc_numerator;
+unsigned long      oden = pcc_denominator;
+unsigned long long clicks;
+long long          adv;
+int                step = 1;
+#endif
+tsillticks++;
+	nanoseq++;
+	COMPILER_BARRIER();
+
+	if ( pcc_seeded ) {
+		/* the first interval started at an arbitrary time (not at
+		 * a tick); stay with the calibrated scale
+		 */
+		rawclicks += setPccBase();
+		pcc_seeded = 0;
+	} else {
+		pcc_denominator = setPccBase();
+		rawclicks      += pcc_denominator;
+#ifdef USE_PCC_SLEW
+		pcc_numerator   = TIMEVAR_NS(TIMEVAR) - tickbase;
+#else
+		pcc_numerator   = TIMEVAR_NS(TIMEVAR) - nanobase;
+#endif
+#ifdef USE_PCC_SLEW
+		clicks = pcc_denominator;
+		adv    = pcc_numerator;
+#endif
+#ifdef USE_PCC_LSQ
+		/* replace the last interval's scale by the fit, if available */
+		pcclsq_update( &pcc_lsq, pcc_denominator, pcc_numerator,
+		               &pcc_numerator, &pcc_denominator );
+#endif
+#ifdef USE_PCC_SLEW
+		step = ticker_slew( clicks, adv, onum, oden );
+#endif
+	}
+#ifdef USE_PCC_SLEW
+	tickbase = TIMEVAR_NS(TIMEVAR);
+	if ( step )
+		nanobase = tickbase;
+#else
+	nanobase = TIMEVAR_NS(TIMEVAR);
+#endif
+	monobase = nanobase - MONO_OFFSET();
+	COMPILER_BARRIER();
+	nanoseq++;
+
+	epoch_record( rawclicks, nanobase, pcc_numerator, pcc_denominator );
+}
+
+/* Time at the last rebase (ns since the epoch); doesn't read the PCC
+ * nor write any shared state and is never later than nano_time_ns().
+ */
+int64_t
+nano_time_coarse()
+{
+int64_t       rval;
+unsigned long seq;
+#ifdef RTEMS_SMP
+	/* micro.c has no global base; use the kernel time */
+	do {
+		seq  = rtems_ntp_timevar_seq;
+		__sync_synchronize();
+		rval = TIMEVAR_NS(TIMEVAR);
+		__sync_synchronize();
+	} while ( (seq & 1) || seq != rtems_ntp_timevar_seq );
+#else
+	do {
+		seq  = nanoseq;
+		COMPILER_BARRIER();
+		rval = nanobase;
+		COMPILER_BARRIER();
+	} while ( (seq & 1) || seq != nanoseq );
+#endif
+	return rval;
+}
+
+void (* volatile rtems_ntp_tick_hook)(void) = 0;
+
+/* Error bound published by the ticker for lock-free readers: the
+ * maximum error at 'errb_since' which then grows at 'errb_tol'.
+ */
+static int64_t					errb_since = 0;	/* ns since the epoch */
+static int64_t					errb_ns    = 0;	/* maximum error (ns) */
+static long						errb_tol   = 0;	/* ns/s */
+static int						errb_state = TIME_ERROR;	/* clock state */
+static volatile unsigned long	errb_seq   = 0;	/* odd while updating */
+
+/* Republish if the discipline changed the bound (the maximum error
+ * grows once per second and is set by the daemon).
+ */
+static inline void
+errbound_publish()
+{
+int64_t e     = (int64_t)time_maxerror * 1000 + time_errfrac;
+int     state = ntp_time_state();
+
+	if ( e == errb_ns && time_tolerance == errb_tol && state == errb_state && errb_since )
+		return;
+
+	errb_seq++;
+	SEQ_BARRIER();
+	errb_ns    = e;
+	errb_since = TIMEVAR_NS(TIMEVAR);
+	errb_tol   = time_tolerance;
+	errb_state = state;
+	SEQ_BARRIER();
+	errb_seq++;
+}
+
+#ifdef USE_ADJTIME_QUEUE
+/* Single-slot request queue. Posters are serialized by the mutex
+ * (single producer); the ticker is the only consumer. The poster
+ * waits for 'adjq_done' so that results can be returned through
+ * 'arg' (uniprocessor only; a compiler barrier orders the accesses).
+ * A request the ticker hasn't picked up within ADJQ_TIMEOUT_SECS is
+ * withdrawn; 'adjq_busy' (claimed with interrupts masked) tells the
+ * poster that it is too late for that.
+ */
+#define ADJQ_TIMEOUT_SECS		1
+
+static void             (* volatile adjq_fn)(void *);
+static void             *adjq_arg;
+static volatile unsigned adjq_head = 0;	/* written by poster */
+static volatile unsigned adjq_tail = 0;	/* written by ticker */
+static volatile int      adjq_busy = 0;	/* ticker is executing it */
+static rtems_id          adjq_done = 0;
+
+/* execute a request; called by the ticker at a tick boundary */
+static inline void
+adjq_run()
+{
+rtems_interrupt_level l;
+
+	if ( adjq_head == adjq_tail )
+		return;
+	ntp_local_disable( l );
+	adjq_busy = ( adjq_head != adjq_tail );
+	ntp_local_enable( l );
+	if ( adjq_busy ) {
+		COMPILER_BARRIER();
+		adjq_fn(adjq_arg);
+		adjq_tail = adjq_head;
+		adjq_busy = 0;
+		rtems_semaphore_release( adjq_done );
+	}
+}
+
+/* run fn(arg) in the ticker's context; RETURNS 0 on success, -1 if
+ * the ticker isn't there or didn't pick the request up in time
+ */
+static int
+adjq_post(void (*fn)(void*), void *arg)
+{
+rtems_interval        tmo;
+rtems_interrupt_level l;
+int                   rval = 0;
+
+	if ( ! rtems_ntp_ticker_id )
+		return -1;
+	rtems_clock_get( RTEMS_CLOCK_GET_TICKS_PER_SECOND, &tmo );
+	tmo *= ADJQ_TIMEOUT_SECS;
+	if ( RTEMS_SUCCESSFUL != rtems_semaphore_obtain( mutex_id, RTEMS_WAIT, RTEMS_NO_TIMEOUT ) )
+		return -1;
+	adjq_fn  = fn;
+	adjq_arg = arg;
+	COMPILER_BARRIER();
+	adjq_head++;
+	while ( RTEMS_SUCCESSFUL != rtems_semaphore_obtain( adjq_done, RTEMS_WAIT, tmo ) ) {
+		ntp_local_disable( l );
+		if ( ! adjq_busy && adjq_head != adjq_tail ) {
+			/* not picked up; withdraw */
+			adjq_head = adjq_tail;
+			rval      = -1;
+		}
+		ntp_local_enable( l );
+		if ( rval )
+			break;
+		/* executing or just done; 'adjq_done' follows */
+	}
+	rtems_semaphore_release( mutex_id );
+	return rval;
+}
+#endif
+
+#if !defined(USE_PICTIMER) && !defined(_USED_FROM_SIMULATOR_)
+/* switch to a new ticker subharmonic; called by the ticker at a
+ * tick boundary with the clock variables locked.
+ */
+static inline void
+ticker_set_divisor()
+{
+unsigned d;
+#ifndef USE_ISR_TICKER
+	/* The rate monotonic period running when the divisor was switched
+	 * still had the old length; it ended at this tick so hz follows
+	 * now.
+	 */
+	if ( (d = rate_divisor_hz) ) {
+		ntp_set_hz( ticks_per_second / d );
+		rate_divisor_hz = 0;
+	}
+#endif
+	if ( (d = rate_divisor_req) ) {
+		rate_divisor     = d;
+		rate_divisor_req = 0;
+#ifdef USE_ISR_TICKER
+		/* the timer is re-armed with the new divisor after this tick */
+		ntp_set_hz( ticks_per_second / d );
+#else
+		rate_divisor_hz  = d;
+#endif
+	}
+}
+#else
+#define ticker_set_divisor()	do {} while (0)
+#endif
+
+#ifdef RTEMS_SMP
+/* have each CPU's microset() task rebase its interpolation */
+static inline void
+microset_notify()
+{
+uint32_t cpu;
+	for ( cpu = 0; cpu < microset_ncpus; cpu++ )
+		rtems_event_send( microset_id[cpu], MICROSET );
+}
+#endif
+
+#ifdef RTEMS_SMP
+/* PCC and time at the last tick (epoch ring, microset()); updated
+ * under rtems_ntp_timevar_seq
+ */
+static unsigned long long tick_lastpcc = 0;
+static int64_t            tick_lastns  = 0;
+#endif
+
+#ifdef _USED_FROM_SIMULATOR_
+#define tod_follow()	do {} while (0)
+#else
+static void tod_follow(void);
+#endif
+
 static inline void
 ticker_body()
 {
 int s;
 unsigned flags;
+#ifdef RTEMS_SMP
+time_t                    sec;
+unsigned long long        pcc, opcc;
+int64_t                   ns, ons;
 
+	/* latch the PCC at the tick, before anything that may delay us */
+	pcc = rpcc() & PCC_RAW_MASK;
+#endif
+
+#ifdef USE_ADJTIME_QUEUE
+	/* we are the only writer; no need to lock */
+	adjq_run();
+	s = 0;
+#else
 	s = splclock();
+#endif
 
+#ifdef RTEMS_SMP
+	/* readers on this CPU must not find the update half done;
+	 * readers on other CPUs retry (see micro.c TIME_READ()). The
+	 * PCC/time pair of the tick is published along with TIMEVAR.
+	 */
+	sec  = TIMEVAR.tv_sec;
+	opcc = tick_lastpcc;
+	ons  = tick_lastns;
+	rtems_interrupt_local_disable(flags);
+	rtems_ntp_timevar_seq++;
+	__sync_synchronize();
+	ntp_tick_adjust(&TIMEVAR, 0);
+	second_overflow(&TIMEVAR);
+	ns           = TIMEVAR_NS(TIMEVAR);
+	tick_lastpcc = pcc;
+	tick_lastns  = ns;
+	__sync_synchronize();
+	rtems_ntp_timevar_seq++;
+	rtems_interrupt_local_enable(flags);
+
+	/* the epoch's scale is that of the last tick interval */
+	if ( opcc )
+		epoch_record( pcc, ns, ns - ons, pcc_diff( pcc, opcc ) );
+
+	errbound_publish();
+	ticker_set_divisor();
+
+	/* about once per second as in micro.c */
+	if ( sec != TIMEVAR.tv_sec )
+		microset_notify();
+#else
 	ntp_tick_adjust(&TIMEVAR, 0);
 	second_overflow(&TIMEVAR);
+	ticker_set_divisor();
 
 	rtems_interrupt_disable(flags);
-tsillticks++;
+	ticker_rebase();
+	rtems_interrupt_enable(flags);
+
+	errbound_publish();
+#endif
+
+	splx(s);
+
+	if ( rtems_ntp_tick_hook )
+		rtems_ntp_tick_hook();
+
+	tod_follow();
+}
+
+#if defined(USE_ISR_TICKER) && !defined(_USED_FROM_SIMULATOR_)
+
+unsigned rtems_ntp_ticker_misses = 0;
+
+/* ISR-mode ticker: advance the clock from interrupt context. Rollover
+ * of the second (second_overflow()) is left to the ticker task which
+ * is notified by an event; until it has run, TIMEVAR's fraction may
+ * exceed one second (nano_time() and the rebase arithmetic cope with
+ * that).
+ */
+void
+rtemsNtpTickerIsr()
+{
+rtems_interrupt_level flags;
+int                   overflow;
 
-	pcc_denominator = setPccBase();
-	pcc_numerator   = 
+	rtems_interrupt_disable(flags);
+	ntp_tick_adjust(&TIMEVAR, 0);
+	ticker_set_divisor();
+	ticker_rebase();
 #ifdef NTP_NANO
-		TIMEVAR.tv_nsec - nanobase.tv_nsec 
+	overflow = TIMEVAR.tv_nsec >= NANOSECOND;
 #else
-		(TIMEVAR.tv_usec - nanobase.tv_usec) * 1000
+	overflow = TIMEVAR.tv_usec >= 1000000;
 #endif
-		+ (TIMEVAR.tv_sec - nanobase.tv_sec) * NANOSECOND
-		;
-	nanobase = TIMEVAR;
 	rtems_interrupt_enable(flags);
 
-	splx(s);
+	if ( overflow && RTEMS_SUCCESSFUL != rtems_event_send( rtems_ntp_ticker_id, SECOND_OVERFLOW ) )
+		rtems_ntp_ticker_misses++;
+
+	if ( rtems_ntp_tick_hook )
+		rtems_ntp_tick_hook();
 }
 
+#ifndef USE_PICTIMER
+static rtems_timer_service_routine tickTimerIsr( rtems_id me, void *uarg )
+{
+	rtemsNtpTickerIsr();
+	/* after the tick so that a new divisor takes effect immediately */
+	rtems_timer_fire_after( me, rate_divisor, tickTimerIsr, uarg );
+}
+#endif
+
+#endif
+
 
 #ifndef _USED_FROM_SIMULATOR_
 
@@ -256,21 +942,757 @@ static rtems_timer_service_routine sysclkIrqHook( rtems_id me, void *uarg )
 #endif
 
 
-/* could use ntp_gettime() for this - avoid the overhead */
-static inline void locked_nano_time(struct timespec *pt)
+/* could use ntp_gettime() for this - avoid the overhead */
+static inline void locked_nano_time(struct timespec *pt)
+{
+#ifdef RTEMS_SMP
+	/* lock-free; micro.c's nano_time() only uses per-CPU state */
+	nano_time(pt);
+#else
+int s;
+	s = splclock();
+	nano_time(pt);
+	splx(s);
+#endif
+}
+
+/* Step the clock by 'ns'; must be called under splclock() (or by the
+ * ticker). The monotonic timescale and the interpolation's rate are
+ * not affected; the monotonicity clamp is stepped along.
+ */
+static void
+clock_step(int64_t ns)
+{
+unsigned flags;
+
+#ifdef RTEMS_SMP
+	rtems_interrupt_local_disable( flags );
+	rtems_ntp_timevar_seq++;
+	__sync_synchronize();
+#endif
+#ifdef NTP_NANO
+	TIMEVAR.tv_sec  += ns / NANOSECOND;
+	TIMEVAR.tv_nsec += ns % NANOSECOND;
+	if ( TIMEVAR.tv_nsec < 0 ) {
+		TIMEVAR.tv_nsec += NANOSECOND;
+		TIMEVAR.tv_sec--;
+	}
+#else
+	TIMEVAR.tv_sec  += ns / NANOSECOND;
+	TIMEVAR.tv_usec += (ns % NANOSECOND) / 1000;
+	if ( TIMEVAR.tv_usec < 0 ) {
+		TIMEVAR.tv_usec += 1000000;
+		TIMEVAR.tv_sec--;
+	}
+#endif
+	/* (a carry is left to second_overflow()) */
+
+#ifdef RTEMS_SMP
+	clock_stepped += ns;
+	tick_lastns   += ns;
+	__sync_synchronize();
+	rtems_ntp_timevar_seq++;
+	rtems_interrupt_local_enable( flags );
+
+	microset_notify();
+#else
+	rtems_interrupt_disable( flags );
+	nanoseq++;
+	COMPILER_BARRIER();
+	clock_stepped += ns;
+	nanobase      += ns;
+	/* the clamp moves with the clock (or a backward step would
+	 * freeze the time until it caught up)
+	 */
+	lasttime      += ns;
+#ifdef USE_PCC_SLEW
+	tickbase      += ns;
+#endif
+	COMPILER_BARRIER();
+	nanoseq++;
+	epoch_record( rawclicks, nanobase, pcc_numerator, pcc_denominator );
+	rtems_interrupt_enable( flags );
+#endif
+
+	/* the error bound grows from the same instant as before */
+	errb_seq++;
+	SEQ_BARRIER();
+	errb_since += ns;
+	SEQ_BARRIER();
+	errb_seq++;
+}
+
+#ifdef USE_ADJTIME_QUEUE
+typedef struct AdjtimeReqRec_ {
+	struct timex	*ntv;
+	int				rval;
+} AdjtimeReqRec;
+
+typedef struct LeapSmearReqRec_ {
+	long			window;
+	int				mode;
+	int				rval;
+} LeapSmearReqRec;
+
+static void adjtimeReq(void *arg)
+{
+AdjtimeReqRec *r = arg;
+	r->rval = ntp_adjtime_apply( r->ntv );
+}
+
+static void hardupdateReq(void *arg)
+{
+	hardupdate( &TIMEVAR, *(long*)arg );
+}
+
+static void stepReq(void *arg)
+{
+	clock_step( *(int64_t*)arg );
+}
+
+static void toleranceReq(void *arg)
+{
+	time_tolerance = *(long*)arg;
+}
+
+static void leapSmearReq(void *arg)
+{
+LeapSmearReqRec *r = arg;
+	if ( 0 == time_smear_len ) {
+		time_smear      = r->window;
+		time_smear_mode = r->mode;
+		r->rval         = 0;
+	}
+}
+#endif
+
+/* RETURNS 0 on success, nonzero if the update wasn't applied */
+static inline int locked_hardupdate(long nsecs)
+{
+#ifdef USE_ADJTIME_QUEUE
+	return adjq_post( hardupdateReq, &nsecs );
+#else
+int s;
+	s = splclock();
+	hardupdate(&TIMEVAR, nsecs );
+	splx(s);
+	return 0;
+#endif
+}
+
+/* RETURNS 0 on success, nonzero if the clock wasn't stepped */
+static inline int locked_step(int64_t ns)
+{
+#ifdef USE_ADJTIME_QUEUE
+	return adjq_post( stepReq, &ns );
+#else
+int s;
+	s = splclock();
+	clock_step( ns );
+	splx(s);
+	return 0;
+#endif
+}
+
+void
+rtemsNtpGetTimeCoarse(struct timespec *ts)
+{
+int64_t t = nano_time_coarse();
+	ts->tv_sec  = t / NANOSECOND;
+	ts->tv_nsec = t % NANOSECOND;
+}
+
+/* RTEMS_NTP_CLOCK_MONOTONIC counts from rtemsNtpInitialize() */
+static int64_t mono_boot = 0;
+
+/* Time on the monotonic timescale (ns); runs at the disciplined
+ * rate but isn't stepped by leap seconds.
+ */
+static int64_t
+mono_time_ns()
+{
+#ifdef RTEMS_SMP
+	/* micro.c's clock holds still during an inserted second rather
+	 * than stepping back; this leaps ahead by the second instead.
+	 */
+	return nano_time_ns() - MONO_OFFSET();
+#else
+static int64_t last = 0;
+int64_t        t;
+long           pccl;
+int            s;
+
+	s = splclock();
+	nano_time_interp(&pccl, &t);
+	if ( t <= last )
+		t = last + 1;
+	last = t;
+	splx(s);
+	return t;
+#endif
+}
+
+/* Free-running PCC: the (masked) counter itself on SMP; the clicks
+ * the ticker has counted plus those since the last tick otherwise.
+ */
+static inline unsigned long long
+raw_clicks()
+{
+#ifdef RTEMS_SMP
+	return (unsigned long long)rpcc() & PCC_RAW_MASK;
+#else
+unsigned long long c;
+unsigned long      seq;
+
+	do {
+		seq = nanoseq;
+		COMPILER_BARRIER();
+		c   = rawclicks + getPcc();
+		COMPILER_BARRIER();
+	} while ( (seq & 1) || seq != nanoseq );
+	return c;
+#endif
+}
+
+/* Undisciplined time (ns): PCC clicks at the calibrated rate or, if
+ * the PCC hasn't been calibrated, the system tick count.
+ */
+static int64_t
+raw_time_ns()
+{
+unsigned long long c, hz;
+#ifdef RTEMS_SMP
+	hz = pcc_rate;
+#else
+rtems_interval     ticks, tps;
+
+	if ( 0 == (hz = pcc_raw_hz) ) {
+		rtems_clock_get( RTEMS_CLOCK_GET_TICKS_PER_SECOND, &tps );
+		rtems_clock_get( RTEMS_CLOCK_GET_TICKS_SINCE_BOOT, &ticks );
+		return (int64_t)ticks * NANOSECOND / tps;
+	}
+#endif
+	c = raw_clicks();
+	return (int64_t)( c / hz * NANOSECOND + c % hz * NANOSECOND / hz );
+}
+
+/* Interpolation base and scale in a form suited for converting many
+ * PCC readings: t = ns +/- (|pcc - base| * mult >> shift), the
+ * difference being split in 32-bit halves so that mult (< 2^32) can
+ * carry as many fraction bits as the rate allows.
+ */
+typedef struct PccEpochRec_ {
+	unsigned long long	pcc;	/* PCC at the base */
+	int64_t				ns;		/* time at the base */
+	unsigned long long	mult;	/* ns per click << shift */
+	int					shift;
+} PccEpochRec, *PccEpoch;
+
+/* RETURNS 0 on success, nonzero if the scale is unusable */
+static int
+pcc_epoch_init(PccEpoch e, unsigned long long pcc, int64_t ns, int64_t numer, int64_t denom)
+{
+	e->pcc   = pcc;
+	e->ns    = ns;
+	e->mult  = 0;
+	e->shift = 0;
+	if ( numer <= 0 || denom <= 0 )
+		return -1;
+
+	while ( numer >> 31 ) {
+		numer >>= 1;
+		denom >>= 1;
+	}
+	if ( 0 == denom )
+		return -1;
+
+	e->shift = 32;
+	e->mult  = ((unsigned long long)numer << 32) / denom;
+	while ( (e->mult >> 32) && e->shift > 0 ) {
+		e->mult >>= 1;
+		e->shift--;
+	}
+	return 0;
+}
+
+/* Current base and scale.
+ * RETURNS 0 on success, nonzero if the scale isn't known yet.
+ */
+static int
+pcc_epoch_get(PccEpoch e)
+{
+int64_t pcc, ns, numer, denom;
+
+	if ( nano_time_scale( &pcc, &ns, &numer, &denom ) )
+		return -1;
+	return pcc_epoch_init( e, pcc, ns, numer, denom );
+}
+
+/* Base and scale in effect when 'pcc' was read; if 'pspan' is not
+ * NULL the number of clicks until the next epoch is stored there (-1
+ * for the newest epoch which also covers later readings).
+ * RETURNS 0 on success, nonzero if 'pcc' predates the recorded epochs.
+ */
+static int
+pcc_epoch_find(PccEpoch e, unsigned long long pcc, int64_t *pspan)
+{
+PccEpochHistRec h;
+unsigned long   seq;
+unsigned        head, i, n;
+int             found;
+unsigned long long next = 0;
+
+	do {
+		seq   = epochseq;
+		SEQ_BARRIER();
+		head  = epoch_head;
+		n     = head < PCC_EPOCHS ? head : PCC_EPOCHS;
+		found = 0;
+		/* newest first */
+		for ( i = 1; i <= n; i++ ) {
+			h = epochs[(head - i) & (PCC_EPOCHS - 1)];
+			if ( pcc_diff( pcc, h.pcc ) >= 0 ) {
+				found = 1;
+				break;
+			}
+			next = h.pcc;
+		}
+		SEQ_BARRIER();
+	} while ( (seq & 1) || seq != epochseq );
+
+	if ( ! found )
+		return -1;
+	if ( pspan )
+		*pspan = i > 1 ? pcc_diff( next, h.pcc ) : -1;
+	return pcc_epoch_init( e, h.pcc, h.ns, h.numer, h.denom );
+}
+
+static inline int64_t
+pcc_epoch_apply(PccEpoch e, unsigned long long pcc)
+{
+int64_t            d = pcc_diff( pcc, e->pcc );
+unsigned long long a;
+int64_t            t;
+
+	a = d < 0 ? -d : d;
+	t = (((a >> 32) * e->mult) << (32 - e->shift))
+	  + (((a & 0xffffffffULL) * e->mult) >> e->shift);
+	return d < 0 ? e->ns - t : e->ns + t;
+}
+
+unsigned long long
+rtemsNtpPccRead()
+{
+	return raw_clicks();
+}
+
+int
+rtemsNtpPccToNs(const unsigned long long *pcc, long long *ns, unsigned n)
+{
+PccEpochRec e;
+unsigned    i;
+
+	if ( pcc_epoch_get( &e ) )
+		return -1;
+
+	for ( i = 0; i < n; i++ )
+		ns[i] = pcc_epoch_apply( &e, pcc[i] );
+	return 0;
+}
+
+int
+rtemsNtpPccToNsPast(unsigned long long pcc, long long *ns)
+{
+PccEpochRec e;
+
+	if ( pcc_epoch_find( &e, pcc, 0 ) )
+		return -1;
+
+	*ns = pcc_epoch_apply( &e, pcc );
+	return 0;
+}
+
+/* Event queue: single producer (an ISR) / single consumer ring */
+typedef struct EvQEntRec_ {
+	unsigned long long	pcc;
+	unsigned long		tag;
+} EvQEntRec;
+
+struct RtemsNtpEvQRec_ {
+	volatile unsigned	head;		/* next to post; producer only */
+	volatile unsigned	tail;		/* next to drain; consumer only */
+	unsigned			mask;
+	volatile unsigned long dropped;	/* posts to a full queue */
+	EvQEntRec			*ents;
+};
+
+RtemsNtpEvQ
+rtemsNtpEvQCreate(unsigned ld_size)
+{
+RtemsNtpEvQ q;
+
+	if ( ld_size > 20 )
+		return 0;
+	if ( ! (q = calloc(1, sizeof(*q))) )
+		return 0;
+	if ( ! (q->ents = calloc(1 << ld_size, sizeof(*q->ents))) ) {
+		free(q);
+		return 0;
+	}
+	q->mask = (1 << ld_size) - 1;
+	return q;
+}
+
+void
+rtemsNtpEvQDestroy(RtemsNtpEvQ q)
+{
+	if ( q ) {
+		free(q->ents);
+		free(q);
+	}
+}
+
+int
+rtemsNtpEvQPost(RtemsNtpEvQ q, unsigned long tag)
+{
+/* read the PCC first; it is what we are here for */
+unsigned long long pcc = raw_clicks();
+unsigned           h   = q->head;
+
+	if ( h - q->tail > q->mask ) {
+		q->dropped++;
+		return -1;
+	}
+	q->ents[h & q->mask].pcc = pcc;
+	q->ents[h & q->mask].tag = tag;
+	SEQ_BARRIER();
+	q->head = h + 1;
+	return 0;
+}
+
+unsigned
+rtemsNtpEvQDrain(RtemsNtpEvQ q, RtemsNtpEv ev, unsigned max)
+{
+unsigned    t, h, n;
+EvQEntRec   *ent;
+PccEpochRec e;
+int64_t     span = 0, d;
+int         have = 0, past = 0;
+unsigned long eseq = 0;
+
+	t = q->tail;
+	h = q->head;
+	SEQ_BARRIER();
+
+	for ( n = 0; t != h && n < max; n++, t++ ) {
+		ent = &q->ents[t & q->mask];
+
+		/* entries are in order; look the epoch up only when the
+		 * cached one doesn't cover the reading. The newest one stops
+		 * covering later readings once the ticker records another;
+		 * convert again if that happened meanwhile.
+		 */
+		do {
+			if (   ! have
+			    || (d = pcc_diff( ent->pcc, e.pcc )) < 0
+			    || (span >= 0 && d >= span)
+			    || (span <  0 && eseq != epochseq) ) {
+				eseq = epochseq;
+				SEQ_BARRIER();
+				past = pcc_epoch_find( &e, ent->pcc, &span );
+				if ( past ) {
+					/* older than the epochs; best effort */
+					past = 1;
+					span = 0;
+					if ( pcc_epoch_get( &e ) ) {
+						/* no scale yet; leave it (and the rest) queued */
+						goto done;
+					}
+				}
+				have = ! past;
+			}
+			ev[n].ns = pcc_epoch_apply( &e, ent->pcc );
+			SEQ_BARRIER();
+		} while ( have && span < 0 && eseq != epochseq );
+
+		ev[n].pcc    = ent->pcc;
+		ev[n].tag    = ent->tag;
+		ev[n].approx = past;
+	}
+
+done:
+	SEQ_BARRIER();
+	q->tail = t;
+	return n;
+}
+
+unsigned long
+rtemsNtpEvQDropped(RtemsNtpEvQ q)
+{
+	return q->dropped;
+}
+
+int
+rtemsNtpGetTimeBounds(long long *earliest, long long *latest)
+{
+int64_t       now, since, err;
+long          tol;
+int           state;
+unsigned long seq;
+
+	do {
+		seq   = errb_seq;
+		SEQ_BARRIER();
+		since = errb_since;
+		err   = errb_ns;
+		tol   = errb_tol;
+		state = errb_state;
+		SEQ_BARRIER();
+	} while ( (seq & 1) || seq != errb_seq );
+
+	now = nano_time_peek();
+	if ( now > since )
+		err += (now - since) / NANOSECOND * tol + (now - since) % NANOSECOND * tol / NANOSECOND;
+
+	*earliest = now - err;
+	*latest   = now + err;
+	return state;
+}
+
+int
+rtemsNtpCrossTimestamp(RtemsNtpDevRead rd, void *arg, unsigned tries, RtemsNtpXtstamp xts)
+{
+rtems_interrupt_level flags;
+unsigned long long    p0, p1, dev, best_p0 = 0, best_w = 0;
+unsigned long long    best_dev = 0;
+PccEpochRec           e;
+int                   have = 0;
+
+	if ( ! rd )
+		return -1;
+	if ( 0 == tries )
+		tries = 1;
+
+	/* bracket the device read by two PCC readings; keep the
+	 * narrowest bracket (least disturbed by bus contention, cache
+	 * misses, ...).
+	 */
+	while ( tries-- ) {
+		ntp_local_disable( flags );
+		p0  = raw_clicks();
+		dev = rd( arg );
+		p1  = raw_clicks();
+		ntp_local_enable( flags );
+
+		if ( pcc_diff( p1, p0 ) < 0 )
+			continue;
+		if ( ! have || (unsigned long long)pcc_diff( p1, p0 ) < best_w ) {
+			best_p0  = p0;
+			best_w   = pcc_diff( p1, p0 );
+			best_dev = dev;
+			have     = 1;
+		}
+	}
+
+	if ( ! have || pcc_epoch_find( &e, best_p0, 0 ) )
+		return -1;
+
+	xts->pcc   = (best_p0 + best_w / 2) & PCC_RAW_MASK;
+	xts->ns    = pcc_epoch_apply( &e, xts->pcc );
+	xts->dev   = best_dev;
+	xts->width = pcc_epoch_apply( &e, best_p0 + best_w ) - pcc_epoch_apply( &e, best_p0 );
+	return 0;
+}
+
+int
+rtemsNtpClockGettime(int clock, struct timespec *ts)
+{
+int64_t t;
+
+	switch ( clock ) {
+		case RTEMS_NTP_CLOCK_REALTIME:
+			locked_nano_time( ts );
+			return 0;
+
+		case RTEMS_NTP_CLOCK_TAI:
+			ntp_gettai( ts );
+			return 0;
+
+		case RTEMS_NTP_CLOCK_MONOTONIC:
+			t = mono_time_ns() - mono_boot;
+			break;
+
+		case RTEMS_NTP_CLOCK_MONOTONIC_RAW:
+			t = raw_time_ns();
+			break;
+
+		default:
+			return -1;
+	}
+	ts->tv_sec  = t / NANOSECOND;
+	ts->tv_nsec = t % NANOSECOND;
+	return 0;
+}
+
+/* Lock-free monotonic reading (safe from an ISR); not clamped */
+static inline int64_t
+mono_time_peek()
+{
+#ifdef RTEMS_SMP
+	return nano_time_ns() - MONO_OFFSET();
+#else
+int64_t base, mono, pccl;
+
+	pccl = nano_time_snap( &base, &mono );
+	return pccl > 0 ? mono + pccl : mono;
+#endif
+}
+
+/* The RTEMS time of day is either fed from the disciplined clock via
+ * a timecounter (RTEMS >= 4.11) or steered to it by setting it
+ * whenever it is off by more than a couple of ticks (once per second
+ * by the ticker).
+ */
+#define TOD_OFF			0
+#define TOD_TIMECOUNTER	1
+#define TOD_STEERED		2
+
+static int     tod_mode    = TOD_OFF;
+static time_t  tod_sec     = 0;
+static int64_t tod_monooff = 0;	/* MONO_OFFSET() when last set */
+
+static void
+tod_set(struct timespec *ts)
+{
+#if RTEMS_VERSION_AT_LEAST(4,10,99)
+	clock_settime( CLOCK_REALTIME, ts );
+#else
+rtems_time_of_day tod;
+struct tm         tm;
+rtems_interval    tps;
+
+	rtems_clock_get( RTEMS_CLOCK_GET_TICKS_PER_SECOND, &tps );
+	gmtime_r( &ts->tv_sec, &tm );
+	tod.year   = tm.tm_year + 1900;
+	tod.month  = tm.tm_mon + 1;
+	tod.day    = tm.tm_mday;
+	tod.hour   = tm.tm_hour;
+	tod.minute = tm.tm_min;
+	tod.second = tm.tm_sec;
+	tod.ticks  = (unsigned long long)ts->tv_nsec * tps / NANOSECOND;
+	rtems_clock_set( &tod );
+#endif
+}
+
+#if RTEMS_VERSION_AT_LEAST(4,10,99)
+static struct timecounter ntp_tc;
+static volatile uint32_t  ntp_tc_last = 0;
+
+/* The counter counts monotonic ns (leap seconds and steps are applied
+ * by tod_follow() setting the TOD).
+ */
+static uint32_t
+ntp_tc_get(struct timecounter *tc)
+{
+uint32_t v = (uint32_t)mono_time_peek();
+uint32_t last;
+
+	/* the timecounter must not go backwards (not even by a ns) */
+	do {
+		last = ntp_tc_last;
+		if ( (int32_t)(v - last) < 0 )
+			return last;
+	} while ( ! __sync_bool_compare_and_swap( &ntp_tc_last, last, v ) );
+	return v;
+}
+#endif
+
+/* Called by the ticker task after each tick; must not take the mutex
+ * (adjq_post() holds it while waiting for the ticker)
+ */
+static void
+tod_follow()
+{
+struct timespec now;
+int64_t         t;
+#if ! RTEMS_VERSION_AT_LEAST(4,10,99)
+struct timeval  tv;
+int64_t         d;
+rtems_interval  tps;
+#endif
+
+	if ( TOD_OFF == tod_mode || TIMEVAR.tv_sec == tod_sec )
+		return;
+	tod_sec = TIMEVAR.tv_sec;
+
+	t           = nano_time_peek();
+	now.tv_sec  = t / NANOSECOND;
+	now.tv_nsec = t % NANOSECOND;
+
+	if ( TOD_TIMECOUNTER == tod_mode ) {
+		/* the counter doesn't see leap seconds nor steps */
+		if ( MONO_OFFSET() != tod_monooff ) {
+			tod_monooff = MONO_OFFSET();
+			tod_set( &now );
+		}
+		return;
+	}
+
+#if ! RTEMS_VERSION_AT_LEAST(4,10,99)
+	rtems_clock_get( RTEMS_CLOCK_GET_TIME_VALUE, &tv );
+	rtems_clock_get( RTEMS_CLOCK_GET_TICKS_PER_SECOND, &tps );
+	d = (int64_t)(tv.tv_sec - now.tv_sec) * NANOSECOND + (tv.tv_usec * 1000 - now.tv_nsec);
+	if ( llabs( d ) > 2 * (NANOSECOND / tps) )
+		tod_set( &now );
+#endif
+}
+
+int
+rtemsNtpTodAttach()
 {
-int s;
-	s = splclock();
-	nano_time(pt);
-	splx(s);
+struct timespec now;
+
+	if ( TOD_OFF != tod_mode || ! rtems_ntp_ticker_id )
+		return -1;
+
+	tod_monooff  = MONO_OFFSET();
+	tod_sec      = 0;
+
+#if RTEMS_VERSION_AT_LEAST(4,10,99)
+	ntp_tc.tc_get_timecount = ntp_tc_get;
+	ntp_tc.tc_counter_mask  = 0xffffffff;
+	ntp_tc.tc_frequency     = NANOSECOND;
+	ntp_tc.tc_quality       = RTEMS_TIMECOUNTER_QUALITY_CLOCK_DRIVER + 100;
+	ntp_tc.tc_name          = "ntp";
+	ntp_tc_last             = (uint32_t)mono_time_peek();
+	rtems_timecounter_install( &ntp_tc );
+
+	/* the counter keeps the TOD on the disciplined time from here */
+	locked_nano_time( &now );
+	tod_set( &now );
+	tod_mode = TOD_TIMECOUNTER;
+#else
+	locked_nano_time( &now );
+	tod_set( &now );
+	tod_mode = TOD_STEERED;
+#endif
+	return 0;
 }
 
-static inline void locked_hardupdate(long nsecs)
+/* ntp_adjtime() to be used once the clock is running */
+int
+rtemsNtpAdjtime(struct timex *ntv)
 {
-int s;
-	s = splclock();
-	hardupdate(&TIMEVAR, nsecs );
-	splx(s);
+#ifdef USE_ADJTIME_QUEUE
+AdjtimeReqRec r;
+	r.ntv  = ntv;
+	r.rval = -1;
+	if ( adjq_post( adjtimeReq, &r ) )
+		return -1;
+	return r.rval;
+#else
+	return ntp_adjtime(ntv);
+#endif
 }
 
 static inline long long nts2ll(struct timestamp *pt)
@@ -456,13 +1878,65 @@ struct timex ntv;
 		poll_seconds = 16;
 
 	ntv.modes    = 0;
-	if ( ntp_adjtime(&ntv) )
+	if ( rtemsNtpAdjtime(&ntv) )
 		return -1;
 
 	ntv.status  |= STA_PLL;
 	ntv.constant = secs2tcld(poll_seconds);
 	ntv.modes    = MOD_TIMECONST | MOD_STATUS;
-	return ntp_adjtime(&ntv);
+	return rtemsNtpAdjtime(&ntv);
+}
+
+/* Configure leap second smearing; a zero window selects stepping.
+ * The window (seconds preceding the leap) can not be changed while
+ * a leap second is being smeared.
+ */
+int
+rtemsNtpSetLeapSmear(long window_secs, int cosine)
+{
+#ifdef USE_ADJTIME_QUEUE
+LeapSmearReqRec r;
+#else
+int s, rval = -1;
+#endif
+
+	if ( window_secs < 0 || window_secs > 86400 )
+		return -1;
+
+#ifdef USE_ADJTIME_QUEUE
+	r.window = window_secs;
+	r.mode   = cosine ? SMEAR_COSINE : SMEAR_LINEAR;
+	r.rval   = -1;
+	if ( adjq_post( leapSmearReq, &r ) )
+		return -1;
+	return r.rval;
+#else
+	s = splclock();
+	if ( 0 == time_smear_len ) {
+		time_smear      = window_secs;
+		time_smear_mode = cosine ? SMEAR_COSINE : SMEAR_LINEAR;
+		rval            = 0;
+	}
+	splx(s);
+	return rval;
+#endif
+}
+
+/* Change the rate of the ticker (in system clock ticks per update)
+ * while running; the new rate takes effect at the next tick. The
+ * divisor must divide the system clock rate (hz is an integer).
+ */
+int
+rtemsNtpSetTickerDivisor(unsigned divisor)
+{
+#ifdef USE_PICTIMER
+	return -1;
+#else
+	if ( 0 == divisor || 0 == ticks_per_second || ticks_per_second % divisor )
+		return -1;
+	rate_divisor_req = divisor;
+	return 0;
+#endif
 }
 
 static rtems_interval
@@ -473,7 +1947,7 @@ rtems_interval rate;
 
 	rtems_clock_get( RTEMS_CLOCK_GET_TICKS_PER_SECOND , &rate );
 	ntv.modes = 0;
-	if ( ntp_adjtime(&ntv) ) {
+	if ( rtemsNtpAdjtime(&ntv) ) {
 		printk("NTP: warning; unable to determine poll interval; using 600s\n");
 		return rate * 600;
 	}
@@ -502,6 +1976,214 @@ int rval;
 }
 
 
+/* Frequency aging model; all frequencies in ns/s, times in s */
+typedef struct HoldoverModelRec_ {
+	double	sw, st, sf, stt, stf;	/* exponentially weighted sums */
+	double	freq;					/* frequency at last sync */
+	double	aging;					/* drift rate (ns/s/s) */
+	double	wander;					/* rms residual of the model */
+	long	t0;						/* origin of 't' sums */
+	long	tlast;					/* time of last sync */
+	int		nsamples;
+} HoldoverModelRec, *HoldoverModel;
+
+static HoldoverModelRec holdover = { 0 };
+
+static double
+holdoverPredict(HoldoverModel m, long now)
+{
+	return m->freq + m->aging * (double)(now - m->tlast);
+}
+
+static void
+holdoverLearn(HoldoverModel m, long now, double freq)
+{
+double t, r, det;
+
+	if ( 0 == m->nsamples )
+		m->t0 = now;
+	else {
+		r = freq - holdoverPredict(m, now);
+		m->wander = sqrt( m->wander * m->wander * (1. - HOLDOVER_DECAY) + r * r * HOLDOVER_DECAY );
+	}
+
+	t = (double)(now - m->t0);
+
+	m->sw  = m->sw  * (1. - HOLDOVER_DECAY) + 1.;
+	m->st  = m->st  * (1. - HOLDOVER_DECAY) + t;
+	m->sf  = m->sf  * (1. - HOLDOVER_DECAY) + freq;
+	m->stt = m->stt * (1. - HOLDOVER_DECAY) + t * t;
+	m->stf = m->stf * (1. - HOLDOVER_DECAY) + t * freq;
+
+	det = m->sw * m->stt - m->st * m->st;
+	if ( det > 0. )
+		m->aging = (m->sw * m->stf - m->st * m->sf) / det;
+
+	m->freq  = freq;
+	m->tlast = now;
+	m->nsamples++;
+}
+
+/* Compute predicted frequency and maxerror growth rate for 'now';
+ * RETURNS: 0 if the model can be used, nonzero otherwise.
+ */
+static int
+holdoverEstimate(HoldoverModel m, long now, long *pfreq, long *ptol)
+{
+double tol;
+
+	if ( m->nsamples < HOLDOVER_MIN_SAMPLES )
+		return -1;
+
+	*pfreq = (long)holdoverPredict(m, now);
+
+	tol = HOLDOVER_MARGIN * ( m->wander + fabs(m->aging) * (double)(now - m->tlast) );
+	if ( tol < HOLDOVER_MIN_TOLERANCE )
+		tol = HOLDOVER_MIN_TOLERANCE;
+	*ptol = tol > MAXFREQ ? MAXFREQ : (long)tol;
+
+	return 0;
+}
+
+static inline void
+locked_set_tolerance(long tol)
+{
+#ifdef USE_ADJTIME_QUEUE
+	adjq_post( toleranceReq, &tol );
+#else
+int s;
+	s = splclock();
+	time_tolerance = tol;
+	splx(s);
+#endif
+}
+
+/* Hardware RTC; times in ns since the epoch */
+typedef struct RtcStateRec_ {
+	RtemsNtpRtcOpsRec	ops;
+	int64_t				base;		/* clock when the drift baseline started */
+	int64_t				baseoff;	/* RTC - clock then */
+	int64_t				offset;		/* RTC - clock at the last check */
+	int64_t				checked;	/* clock at the last check */
+	double				drift;		/* ppm (RTC fast if > 0) */
+	int					seeded;		/* clock was set from the RTC at boot */
+	unsigned long		reads, writes, errors;
+} RtcStateRec, *RtcState;
+
+static RtcStateRec rtc = { { 0 } };
+
+/* The clock has been set from a server (rather than from the RTC) */
+static int clock_set = 0;
+
+static inline int64_t
+ts_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * NANOSECOND + ts->tv_nsec;
+}
+
+static inline unsigned long
+rtc_res(RtcState r)
+{
+	return r->ops.res_ns ? r->ops.res_ns : NANOSECOND;
+}
+
+/* Read the RTC; the reading is truncated to its resolution so take
+ * the middle of the interval.
+ * RETURNS 0 on success.
+ */
+static int
+rtcRead(RtcState r, int64_t *pns)
+{
+struct timespec ts;
+
+	if ( r->ops.read( r->ops.arg, &ts ) ) {
+		r->errors++;
+		return -1;
+	}
+	r->reads++;
+	*pns = ts_ns(&ts) + rtc_res(r)/2;
+	return 0;
+}
+
+/* Called by the daemon after a successful update: estimate the RTC
+ * drift against the disciplined clock and write the RTC back if it is
+ * off by more than its resolution. The drift is measured over the
+ * time since the RTC was last written (or first checked).
+ */
+static void
+rtcSync(RtcState r)
+{
+struct timespec now;
+int64_t         t, off;
+
+	if ( ! r->ops.read || ! clock_set )
+		return;
+
+	locked_nano_time( &now );
+	t = ts_ns(&now);
+	if ( r->checked && t - r->checked < (int64_t)rtems_ntp_rtc_interval * NANOSECOND )
+		return;
+	r->checked = t;
+
+	if ( rtcRead( r, &t ) )
+		return;
+	locked_nano_time( &now );
+	off       = t - ts_ns(&now);
+	r->offset = off;
+
+	if ( r->base && ts_ns(&now) - r->base >= (int64_t)rtems_ntp_rtc_interval * NANOSECOND )
+		r->drift = 1.0E6 * (double)(off - r->baseoff) / (double)(ts_ns(&now) - r->base);
+
+	if ( llabs( off ) > rtc_res(r) && r->ops.write ) {
+		locked_nano_time( &now );
+		if ( r->ops.write( r->ops.arg, &now ) ) {
+			r->errors++;
+			return;
+		}
+		r->writes++;
+		r->base    = ts_ns(&now);
+		r->baseoff = 0;
+	} else if ( ! r->base ) {
+		r->base    = ts_ns(&now);
+		r->baseoff = off;
+	}
+}
+
+/* Set the clock from the server if it was seeded from the RTC;
+ * the offset may exceed what hardupdate() can handle.
+ * RETURNS 0 on success.
+ */
+static int
+initialStep()
+{
+DiffTimeCbDataRec d;
+int64_t           ns;
+
+	if ( rtems_bsdnet_get_ntp(rtems_ntp_daemon_sd, diffTimeCb, &d) )
+		return -1;
+
+	/* 'diff' is 32.32 fixed point seconds */
+	ns = (d.diff >> 32) * NANOSECOND + (((d.diff & 0xffffffffLL) * NANOSECOND) >> 32);
+	if ( locked_step( ns ) )
+		return -1;
+	clock_set = 1;
+
+	if ( rtems_ntp_debug )
+		printf("NTP: clock (set from RTC) stepped by %lli ns\n", (long long)ns);
+	return 0;
+}
+
+int
+rtemsNtpRtcRegister(const RtemsNtpRtcOpsRec *ops)
+{
+	if ( ops && ! ops->read )
+		return -1;
+	memset( &rtc, 0, sizeof(rtc) );
+	if ( ops )
+		rtc.ops = *ops;
+	return 0;
+}
+
 static rtems_task
 ntpDaemon(rtems_task_argument unused)
 {
@@ -516,15 +2198,27 @@ struct timex          ntv;
 int                   failedsyncs;
 unsigned char         leap;
 unsigned              r_s;
+struct timespec       now;
+long                  hfreq, htol;
 
 	ntv.modes = 0;
-	ntp_adjtime(&ntv);
+	rtemsNtpAdjtime(&ntv);
+
+	/* seeded from the RTC; wait for the server to set the clock */
+	while ( ! clock_set && initialStep() ) {
+		if ( RTEMS_TIMEOUT != (rc = rtems_event_receive(
+										KILL_DAEMON,
+										RTEMS_WAIT | RTEMS_EVENT_ANY,
+										get_poll_interval(),
+										&got )) )
+			goto bail;
+	}
 
-	/* initial lookup suceeded (during init); claim we're synced */
+	/* initial lookup suceeded; claim we're synced */
 	ntv.status &= ~ STA_UNSYNC;
 	ntv.modes   = MOD_STATUS;
 
-	ntp_adjtime(&ntv);
+	rtemsNtpAdjtime(&ntv);
 
 	ntv.modes  |= MOD_MAXERROR | MOD_ESTERROR;
 
@@ -576,7 +2270,11 @@ unsigned              r_s;
 				nsecs = frac2nsec(data[best].diff);
 
 #ifndef USE_PROFILER_RAW
-			locked_hardupdate( nsecs ); 
+			if ( locked_hardupdate( nsecs ) ) {
+				/* not applied; try again at the next poll */
+				retry = 0;
+				break;
+			}
 
 			{
 				/* statistics; basic algorithm stolen from ntpd */
@@ -661,22 +2359,40 @@ unsigned              r_s;
 			ntv.status &= ~STA_UNSYNC;
 		}
 
+		locked_nano_time(&now);
+
 		if ( retry > 0 ) {
 			ntv.maxerror = maxerr;
 			ntv.esterror = jitter;
 			ntv.modes  |= MOD_MAXERROR | MOD_ESTERROR;
+			ntv.modes  &= ~MOD_FREQUENCY;
+			locked_set_tolerance( MAXFREQ );
 		} else {
 			ntv.modes  &= ~ (MOD_MAXERROR | MOD_ESTERROR);
+			/* holdover; steer frequency according to the aging model */
+			if ( 0 == holdoverEstimate( &holdover, now.tv_sec, &hfreq, &htol ) ) {
+				ntv.freq    = hfreq * SCALE_PPM;
+				ntv.modes  |= MOD_FREQUENCY;
+				locked_set_tolerance( htol );
+			}
 		}
 
-		ntp_adjtime(&ntv);
+		rtemsNtpAdjtime(&ntv);
+
+		ntv.modes &= ~MOD_FREQUENCY;
 
-		/* TODO: sync / calibrate hwclock hook */
+		if ( retry > 0 && ! (ntv.status & STA_FREQHOLD) )
+			holdoverLearn( &holdover, now.tv_sec, (double)ntv.freq / (double)SCALE_PPM );
+
+		if ( retry > 0 )
+			rtcSync( &rtc );
 	}
 
+bail:
 	ntv.modes  &= ~ (MOD_MAXERROR | MOD_ESTERROR);
 	ntv.status |= STA_UNSYNC;
-	ntp_adjtime(&ntv);
+	rtemsNtpAdjtime(&ntv);
+	locked_set_tolerance( MAXFREQ );
 
 	if ( RTEMS_SUCCESSFUL == rc && (KILL_DAEMON==got) ) {
 		rtems_semaphore_release(kill_sem);
@@ -689,7 +2405,48 @@ unsigned              r_s;
 }
 
 
-#ifndef USE_PICTIMER
+#if defined(USE_ISR_TICKER)
+
+static rtems_task
+tickerDaemon(rtems_task_argument unused)
+{
+rtems_event_set		got;
+int					s, pending;
+
+	while ( 1 ) {
+
+		PARANOIA ( rtems_event_receive(
+									KILL_DAEMON | SECOND_OVERFLOW,
+									RTEMS_WAIT | RTEMS_EVENT_ANY,
+									RTEMS_NO_TIMEOUT,
+									&got ) );
+
+		if ( KILL_DAEMON & got ) {
+			break;
+		}
+
+		/* catch up if we were late by more than a second */
+		do {
+			s = splclock();
+			second_overflow(&TIMEVAR);
+#ifdef NTP_NANO
+			pending = TIMEVAR.tv_nsec >= NANOSECOND;
+#else
+			pending = TIMEVAR.tv_usec >= 1000000;
+#endif
+			errbound_publish();
+			splx(s);
+		} while ( pending );
+
+		tod_follow();
+	}
+
+	/* they killed us */
+	PARANOIA( rtems_semaphore_release( kill_sem ) );
+	rtems_task_suspend( RTEMS_SELF );
+}
+
+#elif !defined(USE_PICTIMER)
 
 unsigned rtems_ntp_ticker_misses = 0;
 
@@ -705,7 +2462,7 @@ rtems_status_code	rc;
 
 	while ( tickerRunning ) {
 
-		rc = rtems_rate_monotonic_period( pid, RATE_DIVISOR );
+		rc = rtems_rate_monotonic_period( pid, rate_divisor );
 
 		if ( RTEMS_TIMEOUT == rc )
 			rtems_ntp_ticker_misses++;
@@ -748,6 +2505,146 @@ rtems_event_set		got;
 }
 #endif
 
+#ifdef RTEMS_SMP
+/* One per CPU (pinned); rebases the CPU's interpolation when the
+ * ticker signals. The PCC/time pair latched by the ticker at the tick
+ * is used so that the task's dispatch latency doesn't matter (the
+ * PCCs of the CPUs are in step; see getPccFree()).
+ */
+static rtems_task
+microsetDaemon(rtems_task_argument unused)
+{
+rtems_event_set		got;
+unsigned long		seq;
+unsigned long long	pcc;
+int64_t				ns;
+struct timespec		ts;
+
+	while ( 1 ) {
+		PARANOIA ( rtems_event_receive(
+									KILL_DAEMON | MICROSET,
+									RTEMS_WAIT | RTEMS_EVENT_ANY,
+									RTEMS_NO_TIMEOUT,
+									&got ) );
+
+		if ( KILL_DAEMON & got ) {
+			break;
+		}
+
+		do {
+			seq = rtems_ntp_timevar_seq;
+			__sync_synchronize();
+			pcc = tick_lastpcc;
+			ns  = tick_lastns;
+			__sync_synchronize();
+		} while ( (seq & 1) || seq != rtems_ntp_timevar_seq );
+
+		if ( pcc ) {
+			ts.tv_sec  = ns / NANOSECOND;
+			ts.tv_nsec = ns % NANOSECOND;
+			microset_from_saved( pcc, &ts );
+		} else {
+			/* no tick yet */
+			microset();
+		}
+	}
+
+	/* they killed us */
+	PARANOIA( rtems_semaphore_release( kill_sem ) );
+	rtems_task_suspend( RTEMS_SELF );
+}
+
+/* start a microset() task on each CPU; RETURNS 0 on success */
+static int
+startMicroset(unsigned pri)
+{
+uint32_t  ncpus = rtems_get_processor_count();
+uint32_t  cpu;
+cpu_set_t set;
+
+	if ( ncpus > NCPUS )
+		ncpus = NCPUS;
+
+	for ( cpu = 0; cpu < ncpus; cpu++ ) {
+		CPU_ZERO( &set );
+		CPU_SET( cpu, &set );
+		if ( RTEMS_SUCCESSFUL != rtems_task_create(
+								rtems_build_name('N','T','P','u'),
+								pri,
+								RTEMS_MINIMUM_STACK_SIZE,
+								RTEMS_DEFAULT_MODES,
+								RTEMS_DEFAULT_ATTRIBUTES,
+								&microset_id[cpu]) )
+			return -1;
+		microset_ncpus = cpu + 1;
+		if ( RTEMS_SUCCESSFUL != rtems_task_set_affinity( microset_id[cpu], sizeof(set), &set ) ||
+		     RTEMS_SUCCESSFUL != rtems_task_start( microset_id[cpu], microsetDaemon, 0 ) )
+			return -1;
+		/* establish the base */
+		rtems_event_send( microset_id[cpu], MICROSET );
+	}
+	return 0;
+}
+#endif
+
+/* Measure the PCC rate against the system clock tick over 'ms'
+ * milliseconds and seed the interpolation scale with it, so that
+ * nano_time() is accurate before the ticker has completed a full
+ * interval. Must be called before the ticker is started.
+ * RETURNS 0 on success.
+ */
+static int
+calibratePcc(unsigned ms)
+{
+#if defined(USE_PICTIMER) || defined(USE_NO_HIGH_RESOLUTION_CLOCK)
+	return -1;
+#else
+rtems_interval     t0, t1, n;
+unsigned long long clicks, ns;
+unsigned           flags;
+
+	n = (ms * ticks_per_second + 999) / 1000;
+	if ( 0 == n )
+		return -1;
+
+	/* start right after a tick */
+	rtems_task_wake_after( 1 );
+	ntp_local_disable( flags );
+	rtems_clock_get( RTEMS_CLOCK_GET_TICKS_SINCE_BOOT, &t0 );
+	setPccBase();
+	ntp_local_enable( flags );
+
+	rtems_task_wake_after( n );
+
+	ntp_local_disable( flags );
+	rtems_clock_get( RTEMS_CLOCK_GET_TICKS_SINCE_BOOT, &t1 );
+	clicks = setPccBase();
+	ntp_local_enable( flags );
+
+	ns = (unsigned long long)(t1 - t0) * NANOSECOND / ticks_per_second;
+	if ( 0 == clicks || 0 == ns )
+		return -1;
+
+	pcc_cal_clicks = clicks;
+	pcc_cal_ns     = ns;
+	pcc_raw_hz     = clicks * NANOSECOND / ns;
+#ifdef RTEMS_SMP
+	/* seeds the per-CPU rates in microset() */
+	pcc_rate = clicks * NANOSECOND / ns;
+#endif
+
+	/* scale down to fit; nano_time() multiplies by the numerator */
+	while ( (clicks >> 32) || (ns >> 31) ) {
+		clicks >>= 1;
+		ns     >>= 1;
+	}
+
+	pcc_denominator = clicks;
+	pcc_numerator   = ns;
+	return 0;
+#endif
+}
+
 static void
 closeSd()
 {
@@ -764,6 +2661,7 @@ rtemsNtpInitialize(unsigned tickerPri, unsigned daemonPri)
 struct timex    ntv;
 struct timespec initime;
 struct sockaddr me;
+int64_t         rtcns;
 
 	if ( ! tickerPri ) {
 		tickerPri = 35;
@@ -776,7 +2674,7 @@ struct sockaddr me;
 		if ( daemonPri > 2 )
 			daemonPri -= 2;
 	}
-	/* TODO: recover frequency from NVRAM; read time from hwclock */
+	/* TODO: recover frequency from NVRAM */
 
 	ntv.offset = 0;
 	ntv.freq   = 0;
@@ -791,15 +2689,20 @@ struct sockaddr me;
 #ifdef USE_PICTIMER
 	hz = TIMER_FREQ;
 #else
-	{
-	rtems_interval rate;
-	rtems_clock_get( RTEMS_CLOCK_GET_TICKS_PER_SECOND , &rate );
-	hz = rate / RATE_DIVISOR;
-	}
+	rtems_clock_get( RTEMS_CLOCK_GET_TICKS_PER_SECOND , &ticks_per_second );
+	hz = ticks_per_second / rate_divisor;
+#endif
+
+#ifdef NTP_HZ
+	if ( hz != NTP_HZ )
+		fprintf(stderr,"rtemsNtpInitialize(): NOTE: hz (%i) != NTP_HZ (%i); tick path not specialized\n", hz, NTP_HZ);
 #endif
 
 	ntp_init();
-	ntp_adjtime(&ntv);
+	/* nothing else is running yet (and queued requests would wait
+	 * for the ticker)
+	 */
+	ntp_adjtime_apply(&ntv);
 
 #ifdef USE_PICTIMER
 	if ( pictimerInstallClock( TIMER_NO ) ) {
@@ -826,15 +2729,35 @@ struct sockaddr me;
 		}
 	}
 
-	fprintf(stderr,"Trying to contact NTP server; (timeout ~1min.)... ");
-	fflush(stderr);
+	if ( pccProbe() ) {
+		fprintf(stderr,"WARNING: High resolution clock unusable on this CPU; using tick resolution\n");
+	} else if ( rtems_ntp_pcc_calibration_ms ) {
+		fprintf(stderr,"Calibrating PCC (%ums)... ", rtems_ntp_pcc_calibration_ms);
+		fflush(stderr);
+		fprintf(stderr, calibratePcc( rtems_ntp_pcc_calibration_ms ) ? "not available\n" : "OK\n");
+	}
 
-	/* initialize time */
-	if ( rtems_bsdnet_get_ntp(rtems_ntp_daemon_sd, 0, &initime) ) {
-		fprintf(stderr,"FAILED: check networking setup and try again\n");
-		goto bail;
+	/* initialize time; from the RTC if there is one (the daemon sets
+	 * the clock when the server answers) so that we needn't wait for
+	 * the network.
+	 */
+	clock_set = 0;
+	if ( rtc.ops.read && 0 == rtcRead( &rtc, &rtcns ) ) {
+		initime.tv_sec  = rtcns / NANOSECOND;
+		initime.tv_nsec = rtcns % NANOSECOND;
+		rtc.seeded      = 1;
+		fprintf(stderr,"Clock set from the RTC; NTP server will be contacted by the daemon\n");
+	} else {
+		fprintf(stderr,"Trying to contact NTP server; (timeout ~1min.)... ");
+		fflush(stderr);
+
+		if ( rtems_bsdnet_get_ntp(rtems_ntp_daemon_sd, 0, &initime) ) {
+			fprintf(stderr,"FAILED: check networking setup and try again\n");
+			goto bail;
+		}
+		fprintf(stderr,"OK\n");
+		clock_set = 1;
 	}
-	fprintf(stderr,"OK\n");
 
 #ifdef NTP_NANO
 	TIMEVAR = initime;
@@ -842,7 +2765,20 @@ struct sockaddr me;
 	TIMEVAR.tv_sec  = initime.tv_sec;
 	TIMEVAR.tv_usec = initime.tv_nsec/1000;
 #endif
+	mono_boot = TIMEVAR_NS(TIMEVAR);
+	monobase  = mono_boot;	/* until the first tick */
+
+	if ( pcc_cal_clicks ) {
+	unsigned flags;
+		/* start interpolating from the initial time */
+		ntp_local_disable( flags );
+		setPccBase();
+		nanobase   = TIMEVAR_NS(TIMEVAR);
+		pcc_seeded = 1;
+		ntp_local_enable( flags );
+	}
 
+#ifndef USE_ISR_TICKER
 	if ( RTEMS_SUCCESSFUL != rtems_semaphore_create(
 								rtems_build_name('N','T','P','m'),
 								1,
@@ -853,6 +2789,18 @@ struct sockaddr me;
 		printf("Unable to create mutex\n");
 		goto bail;
 	}
+#endif
+#ifdef USE_ADJTIME_QUEUE
+	if ( RTEMS_SUCCESSFUL != rtems_semaphore_create(
+								rtems_build_name('N','T','P','q'),
+								0,
+								RTEMS_LOCAL | RTEMS_SIMPLE_BINARY_SEMAPHORE,
+								0,
+								&adjq_done ) ) {
+		printf("Unable to create semaphore\n");
+		goto bail;
+	}
+#endif
 
 	if ( RTEMS_SUCCESSFUL != rtems_task_create(
 								rtems_build_name('C','L','K','d'),
@@ -866,6 +2814,13 @@ struct sockaddr me;
 		goto bail;
 	}
 
+#ifdef RTEMS_SMP
+	if ( startMicroset( tickerPri ) ) {
+		printf("Per-CPU microset tasks couldn't be started :-(\n");
+		goto bail;
+	}
+#endif
+
 	if ( RTEMS_SUCCESSFUL != rtems_task_create(
 								rtems_build_name('N','T','P','d'),
 								daemonPri,
@@ -889,6 +2844,11 @@ struct sockaddr me;
 #ifdef USE_PICTIMER
 	/* start timer */
 	pictimerEnable(TIMER_NO, 1);
+#elif defined(USE_ISR_TICKER)
+	PARANOIA( rtems_timer_create(
+					rtems_build_name('N','T','P','c'),
+					&tick_timer_id) );
+	PARANOIA( rtems_timer_fire_after( tick_timer_id, rate_divisor, tickTimerIsr, 0 ) );
 #endif
 #ifdef USE_PROFILER
 	pictimerProfileInstall();
@@ -911,6 +2871,12 @@ bail1:
 
 int rtemsNtpCleanup()
 {
+	if ( TOD_TIMECOUNTER == tod_mode ) {
+		/* a timecounter can't be removed */
+		fprintf(stderr,"rtemsNtpCleanup(): the RTEMS timecounter depends on the clock; cannot stop it\n");
+		return -1;
+	}
+	tod_mode = TOD_OFF;
 
 #ifdef USE_PICTIMER
 	if ( pictimerCleanup(TIMER_NO) ) {
@@ -930,7 +2896,13 @@ int rtemsNtpCleanup()
 				PARANOIA( rtems_task_delete( rtems_ntp_daemon_id ));
 			}
 			if ( rtems_ntp_ticker_id ) {
-#ifdef USE_PICTIMER
+#if defined(USE_ISR_TICKER) && !defined(USE_PICTIMER)
+				if ( tick_timer_id ) {
+					PARANOIA( rtems_timer_delete( tick_timer_id ) );
+					tick_timer_id = 0;
+				}
+#endif
+#if defined(USE_PICTIMER) || defined(USE_ISR_TICKER)
 				PARANOIA( rtems_event_send( rtems_ntp_ticker_id, KILL_DAEMON ) );
 #else
 				tickerRunning = 0;
@@ -939,6 +2911,14 @@ int rtemsNtpCleanup()
 				PARANOIA( rtems_semaphore_obtain( kill_sem, RTEMS_WAIT, RTEMS_NO_TIMEOUT ) );
 				PARANOIA( rtems_task_delete( rtems_ntp_ticker_id ) );
 			}
+#ifdef RTEMS_SMP
+			while ( microset_ncpus > 0 ) {
+				microset_ncpus--;
+				PARANOIA( rtems_event_send( microset_id[microset_ncpus], KILL_DAEMON ) );
+				PARANOIA( rtems_semaphore_obtain( kill_sem, RTEMS_WAIT, RTEMS_NO_TIMEOUT ) );
+				PARANOIA( rtems_task_delete( microset_id[microset_ncpus] ) );
+			}
+#endif
 			PARANOIA( rtems_semaphore_release( kill_sem ) );
 			PARANOIA( rtems_semaphore_delete( kill_sem ) );	
 	} else {
@@ -952,6 +2932,10 @@ int rtemsNtpCleanup()
 
 	if ( mutex_id )
 		PARANOIA( rtems_semaphore_delete( mutex_id ) );
+#ifdef USE_ADJTIME_QUEUE
+	if ( adjq_done )
+		PARANOIA( rtems_semaphore_delete( adjq_done ) );
+#endif
 
 	closeSd();
 
@@ -986,12 +2970,15 @@ static char *yesno(struct timex *p, unsigned mask)
 long rtemsNtpDumpStats(FILE *f)
 {
 struct timex ntp;
+#ifdef RTEMS_SMP
+uint32_t     i;
+#endif
 
 	if ( !f )
 		f = stdout;
 
 	memset( &ntp, 0, sizeof(ntp) );
-	if ( 0 == ntp_adjtime( &ntp ) ) {
+	if ( 0 == rtemsNtpAdjtime( &ntp ) ) {
 		fprintf(stderr,"Current Timex Values:\n");
 		fprintf(stderr,"            time offset %11li "UNITS"\n",  ntp.offset);
 		fprintf(stderr,"       frequency offset %11.3f ""ppm""\n", (double)ntp.freq/PPM_SCALED);
@@ -1010,12 +2997,48 @@ struct timex ntp;
 		fprintf(stderr,     "          %ssecond resolution\n", ntp.status & STA_NANO ? " nano" : "micro");
 		fprintf(stderr,"         operation mode %s\n", ntp.status & STA_MODE ? "FLL" : "PLL");
 		fprintf(stderr,"           clock source %s\n", ntp.status & STA_CLK  ? "B"   : "A");
+		fprintf(stderr,"            ticker rate %11i ""Hz""\n",   hz);
+		if ( time_smear )
+		fprintf(stderr,"      leap smear window %11li  ""S"" (%s)\n", time_smear, SMEAR_COSINE == time_smear_mode ? "cosine" : "linear");
 	}
+		if ( pcc_cal_clicks )
+		fprintf(stderr,"Boot Calibration: %llu clicks/%llu ns = %.10g MHz\n",
+							pcc_cal_clicks,
+							pcc_cal_ns,
+							(double)pcc_cal_clicks/(double)pcc_cal_ns*1000.);
+		else
+		fprintf(stderr,"Boot Calibration: not performed\n");
 		fprintf(stderr,"Estimated Nanoclock Frequency:\n");
+#ifdef RTEMS_SMP
+		for ( i = 0; i < microset_ncpus; i++ )
+		fprintf(stderr,"   CPU %2u: %lli clicks/%lli ns = %.10g MHz\n",
+							(unsigned)i,
+							(long long)pcc_denom[i],
+							(long long)pcc_numer[i],
+							pcc_numer[i] ? (double)pcc_denom[i]/(double)pcc_numer[i]*1000. : (double)-1.);
+#else
 		fprintf(stderr,"   %lu clicks/%lu ns = %.10g MHz\n",
 							pcc_denominator,
 							pcc_numerator,
 							pcc_numerator ? (double)pcc_denominator/(double)pcc_numerator*1000. : (double)-1.);
+#endif
+#if defined(USE_PCC_LSQ) && !defined(RTEMS_SMP)
+		fprintf(stderr,"   (least-squares fit over %i ticks; %lu readings rejected)\n",
+							pcc_lsq.n,
+							pcc_lsq.nrejected);
+#endif
+		fprintf(stderr,"Holdover Model (%i samples%s):\n",
+							holdover.nsamples,
+							holdover.nsamples < HOLDOVER_MIN_SAMPLES ? ", NOT USABLE YET" : "");
+		fprintf(stderr,"        frequency aging %11.3f ""ppm/day""\n", holdover.aging * 86400. / 1000.);
+		fprintf(stderr,"       frequency wander %11.3f ""ppm""\n",     holdover.wander / 1000.);
+		fprintf(stderr,"        maxerror growth %11.3f ""ppm""\n",     (double)time_tolerance / 1000.);
+	if ( rtc.ops.read ) {
+		fprintf(stderr,"Hardware RTC (%sseeded the clock):\n", rtc.seeded ? "" : "not ");
+		fprintf(stderr,"   reads/writes/errors %lu/%lu/%lu\n", rtc.reads, rtc.writes, rtc.errors);
+		fprintf(stderr,"           last offset %11.3f ""ms""\n",  (double)rtc.offset / 1.0E6);
+		fprintf(stderr,"                 drift %11.3f ""ppm""\n", rtc.drift);
+	}
 	return 0;
 }
 
@@ -6,20 +6,63 @@
 #define TIMER_NO  		0	/* note that svgmWatchdog uses T3 */
 #define TIMER_FREQ 		50
 #else
-#define RATE_DIVISOR	1
+#define RATE_DIVISOR	1	/* default; see rtemsNtpSetTickerDivisor() */
 #endif
 
 #include <rtems.h>
 
+#ifdef RTEMS_SMP
+/* Each CPU interpolates from its own PCC (micro.c); splsched() and
+ * splextreme() keep the caller on its CPU by masking local interrupts
+ * and must be undone by splx_sched() (splx() releases splclock()).
+ */
+#define cpu_number()	((int)rtems_get_current_processor())
+int  rtemsNtpSplLocal(void);
+void rtemsNtpSplxLocal(int level);
+#define splsched()		rtemsNtpSplLocal()
+#define splextreme()	rtemsNtpSplLocal()
+#define splx_sched(s)	rtemsNtpSplxLocal(s)
+/* bumped by the ticker around updates of TIMEVAR; odd while updating */
+extern volatile unsigned long rtems_ntp_timevar_seq;
+/* mask interrupts on this CPU only (to pair readings taken on it) */
+#define ntp_local_disable(l)	rtems_interrupt_local_disable(l)
+#define ntp_local_enable(l)		rtems_interrupt_local_enable(l)
+#else
 #define cpu_number() (0)
-
 #define splsched() (0)
 #define splextreme() (0)
+#define ntp_local_disable(l)	rtems_interrupt_disable(l)
+#define ntp_local_enable(l)		rtems_interrupt_enable(l)
+#endif
+
+/* called by the ticker after each tick (from the ISR with
+ * USE_ISR_TICKER); used by the timer service
+ */
+extern void (* volatile rtems_ntp_tick_hook)(void);
+
+#if defined(USE_ADJTIME_QUEUE) && !defined(_USED_FROM_SIMULATOR_)
+/* the ticker is the only writer of the discipline state; ntp_adjtime()
+ * (ktime.c) hands the request to it rather than using splclock()
+ */
+struct timex;
+int rtemsNtpAdjtime(struct timex *ntv);
+#define ntp_adjtime_queued(tp)	rtemsNtpAdjtime(tp)
+#endif
+
+#ifdef USE_ISR_TICKER
+/* clock tick handler; called from the clock interrupt */
+void rtemsNtpTickerIsr();
+#endif
 
 #if defined(USE_PICTIMER) && !defined(__PPC__)
 #error Configuration error -- cannot use PICTIMER on non-PowerPC arch
 #endif
 
+#if defined(RTEMS_SMP) && (defined(USE_ISR_TICKER) || defined(USE_ADJTIME_QUEUE) || defined(USE_PICTIMER))
+/* these rely on masking interrupts to exclude other users of the clock */
+#error Configuration error -- USE_ISR_TICKER, USE_ADJTIME_QUEUE and USE_PICTIMER are uniprocessor only
+#endif
+
 #ifndef RTEMS_VERSION_AT_LEAST
 #define RTEMS_VERSION_AT_LEAST(ma,mi,re) \
 	(    __RTEMS_MAJOR__  > (ma)	\
@@ -10,54 +10,15 @@
 
 #define NS 1000000000
 
-struct timespec real_time   = {0, 0};
-struct timespec real_rate   = {0, NS/TICKS_PER_S};
+/* max. offset after a smeared leap second (-L) */
+#define LEAP_TOL_US	1000
+
+long long       real_time   = 0;	/* ns */
+long long       real_rate   = NS/TICKS_PER_S;
 unsigned        max_ticks   = 1000*TICKS_PER_S;
 unsigned        disp_ticks  = TICKS_PER_S;
 unsigned        poll_ticks  = TICKS_PER_S;
 
-void
-tsadd(struct timespec *res, struct timespec *ts1, struct timespec *ts2)
-{
-	res->tv_sec   = ts1->tv_sec  + ts2->tv_sec;
-	res->tv_nsec  = ts1->tv_nsec + ts2->tv_nsec;
-	while ( res->tv_nsec >= NS ) {
-		res->tv_nsec -= NS;
-		res->tv_sec++;
-	}
-	while ( res->tv_nsec < 0 ) {
-		res->tv_nsec += NS;
-		res->tv_sec--;
-	}
-}
-
-void
-tsdiff(struct timespec *res, struct timespec *ts1, struct timespec *ts2)
-{
-struct timespec tmp = *ts2;
-	tmp.tv_sec  = - tmp.tv_sec;
-	tmp.tv_nsec = - tmp.tv_nsec;
-	tsadd(res, ts1, &tmp);
-}
-
-void
-tsinc(struct timespec *ts1, struct timespec *ts2)
-{
-	tsadd(ts1, ts1, ts2);
-}
-
-long long tsdiff_ns(struct timespec *ts1, struct timespec *ts2)
-{
-long long res =  (long long)(unsigned long)ts1->tv_sec
-               - (long long)(unsigned long)ts2->tv_sec;
-
-          res *=  NS;
-          res +=   (long long)(unsigned long)ts1->tv_nsec
-                 - (long long)(unsigned long)ts2->tv_nsec;
-
-	return res;
-}
-
 int
 splclock()
 {
@@ -107,7 +68,7 @@ gd(const char *s, double *pd)
 static void
 usage(const char *nm)
 {
-	fprintf(stderr,"Usage: %s [-ahSF] [-c time_const] [-d interval] [-o time_off], [-f freq_off] [-p poll_interval] [-j time_jitter] [-t time_end]\n", nm);
+	fprintf(stderr,"Usage: %s [-ahSF] [-c time_const] [-d interval] [-o time_off], [-f freq_off] [-p poll_interval] [-j time_jitter] [-t time_end] [-L smear_window]\n", nm);
 	fprintf(stderr,"       -h             : print this message\n");
 	fprintf(stderr,"       -a             : Alternate output format (offset/freq only)\n");
 	fprintf(stderr,"       -c             : PLL time constant (s)\n");
@@ -119,6 +80,9 @@ usage(const char *nm)
 	fprintf(stderr,"       -p poll_intvl  : NTP poll/update interval (s)\n");
 	fprintf(stderr,"       -t time_end    : Simulation end time (s)\n");
 	fprintf(stderr,"       -S             : Use fixed seed\n");
+	fprintf(stderr,"       -L smear_win   : Insert a leap second, smeared over 'smear_win' (s); the\n");
+	fprintf(stderr,"                        simulation starts a minute before the smear. Fails\n");
+	fprintf(stderr,"                        unless the clock is within %dus after the leap.\n", LEAP_TOL_US);
 }
 
 int main(int argc, char **argv)
@@ -133,6 +97,9 @@ int          fixed_seed   = 0;
 double       off_m1       = 0.;
 double       off_m2       = 0.;
 int          alt_fmt      = 0;
+long         smear_win    = 0;
+long long    leap_at      = 0;	/* real time of the leap (ns), 0: none */
+long long    leap_off     = 0;	/* offset at the end of the smear */
 
 	ntv.offset   = 0;
 	ntv.freq     = 0;
@@ -142,7 +109,7 @@ int          alt_fmt      = 0;
 
 	hz           = TICKS_PER_S;
 
-	while ( (i=getopt(argc, argv, "ahc:d:f:Fj:o:p:t:S")) > 0 ) {
+	while ( (i=getopt(argc, argv, "ahc:d:f:Fj:L:o:p:t:S")) > 0 ) {
 		switch ( i ) {
 			case 'h':
 			default:
@@ -174,7 +141,7 @@ int          alt_fmt      = 0;
 			case 'f':
 				if ( gd(optarg, &tmpd) ) return 1;
 
-				real_rate.tv_nsec *= 1.0 + tmpd/1.0E6;
+				real_rate *= 1.0 + tmpd/1.0E6;
 
 				break;
 
@@ -186,6 +153,15 @@ int          alt_fmt      = 0;
 				if ( gd(optarg, &jitter_scale) ) return 1;
 			break;
 
+			case 'L':
+				if ( gd(optarg, &tmpd) ) return 1;
+				smear_win = tmpd;
+				if ( smear_win <= 0 || smear_win > 86400 ) {
+					fprintf(stderr,"Smear window must be 1..86400s\n");
+					return 1;
+				}
+				break;
+
 			case 'o':
 				if ( gd(optarg, &toff) ) return 1;
 
@@ -240,17 +216,27 @@ int          alt_fmt      = 0;
 	}
 
 	ntp_init();
+
+	if ( smear_win ) {
+		/* start a minute before the smear; midnight UTC is a leap */
+		leap_at          = 86400LL * NS;
+		real_time        = leap_at - (smear_win + 60) * (long long)NS;
+		TIMEVAR.tv_sec  += real_time / NS;
+		time_smear       = smear_win;
+		ntv.status      |= STA_INS;
+	}
+
 	ntp_adjtime(&ntv);
 
 	if ( !alt_fmt )
 		printf("Tick  #:  Toff/us: Foff/ppm:   SysTime/s.ns:  RealTime/s.ns:\n");
 	for ( i=0; i<max_ticks; i++ ) {
-		long long off = tsdiff_ns(&real_time, &TIMEVAR);
+		long long off = real_time - TIMEVAR_NS(TIMEVAR);
 		if ( i % disp_ticks == 0 ) {
 			ntv.modes = 0;
 			ntp_adjtime(&ntv);
 			tmpd = (double)NS + (double)ntv.freq/(double)SCALE_PPM;
-			tmpd/= (double)real_rate.tv_nsec * (double)TICKS_PER_S;
+			tmpd/= (double)real_rate * (double)TICKS_PER_S;
 			printf("%8u %9lld %9.1lf",
                    i,
 			       -off/1000,
@@ -258,16 +244,24 @@ int          alt_fmt      = 0;
 			if ( ! alt_fmt )
 				printf(" %5ld.%09ld %5ld.%09ld",
                    TIMEVAR.tv_sec, TIMEVAR.tv_nsec,
-                   real_time.tv_sec, real_time.tv_nsec);
+                   (long)(real_time / NS), (long)(real_time % NS));
 			fputc('\n',stdout);
 		}
 		off_m1 += off;
 		off_m2 += (double)off * (double)off;
 
-		tsinc(&real_time, &real_rate);
-		ticker_body();
+		real_time += real_rate;
+		if ( leap_at && real_time >= leap_at ) {
+			/* 23:59:60 -- UTC repeats a second */
+			real_time -= NS;
+			leap_at    = 0;
+			ticker_body();
+			leap_off   = real_time - TIMEVAR_NS(TIMEVAR);
+		} else {
+			ticker_body();
+		}
 		if ( i % poll_ticks == 0 ) {
-			off = tsdiff_ns(&real_time, &TIMEVAR);
+			off = real_time - TIMEVAR_NS(TIMEVAR);
 
 			if ( jitter_scale > 0. ) {
 				double jitter = - log(drand48() * drand48());
@@ -285,5 +279,15 @@ int          alt_fmt      = 0;
 	if ( !alt_fmt )
 		printf("Mean offset: %lgus, variance %lgus\n", off_m1/1000., sqrt(off_m2-off_m1*off_m1)/1000.);
 
+	if ( smear_win ) {
+		if ( leap_at ) {
+			fprintf(stderr,"Leap second not reached; increase -t\n");
+			return 1;
+		}
+		printf("Leap smear: offset %lldus after the leap\n", leap_off/1000);
+		if ( llabs( leap_off ) > LEAP_TOL_US * 1000LL )
+			return 1;
+	}
+
 	return 0;
 }